@@ -1,3 +1,6 @@
+#ifndef BMP_H
+#define BMP_H
+
 #include <stdint.h>
 
 // Basic data types for BMP headers
@@ -38,4 +41,6 @@ typedef struct
     BYTE  rgbtBlue;
     BYTE  rgbtGreen;
     BYTE  rgbtRed;
-} __attribute__((__packed__)) RGBTRIPLE;
\ No newline at end of file
+} __attribute__((__packed__)) RGBTRIPLE;
+
+#endif // BMP_H
@@ -0,0 +1,109 @@
+#include "bmpio.h"
+
+// Determine padding for scanlines
+static int bmp_padding(int width)
+{
+    return (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
+}
+
+// Read infile's headers and check it is a 24-bit uncompressed BMP 4.0
+int read_bmp_headers(FILE *inptr, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi)
+{
+    // Read infile's BITMAPFILEHEADER
+    if (fread(bf, sizeof(BITMAPFILEHEADER), 1, inptr) != 1)
+    {
+        return 1;
+    }
+
+    // Read infile's BITMAPINFOHEADER
+    if (fread(bi, sizeof(BITMAPINFOHEADER), 1, inptr) != 1)
+    {
+        return 1;
+    }
+
+    // Ensure infile is (likely) a 24-bit uncompressed BMP 4.0
+    if (bf->bfType != 0x4d42 || bf->bfOffBits != 54 || bi->biSize != 40 ||
+        bi->biBitCount != 24 || bi->biCompression != 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+// Read pixel rows into image, skipping scanline padding
+void read_bmp_pixels(FILE *inptr, int height, int width, RGBTRIPLE image[height][width])
+{
+    int padding = bmp_padding(width);
+
+    // Iterate over infile's scanlines
+    for (int i = 0; i < height; i++)
+    {
+        // Read row into pixel array
+        fread(image[i], sizeof(RGBTRIPLE), width, inptr);
+
+        // Skip over padding
+        fseek(inptr, padding, SEEK_CUR);
+    }
+}
+
+// Fill in headers for a new top-down 24-bit uncompressed BMP
+void init_bmp_headers(int height, int width, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi)
+{
+    DWORD image_size = (width * sizeof(RGBTRIPLE) + bmp_padding(width)) * height;
+
+    bf->bfType = 0x4d42;
+    bf->bfSize = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + image_size;
+    bf->bfReserved1 = 0;
+    bf->bfReserved2 = 0;
+    bf->bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+
+    // A negative height means rows are stored top to bottom, as in memory
+    bi->biSize = sizeof(BITMAPINFOHEADER);
+    bi->biWidth = width;
+    bi->biHeight = -height;
+    bi->biPlanes = 1;
+    bi->biBitCount = 24;
+    bi->biCompression = 0;
+    bi->biSizeImage = image_size;
+    bi->biXPelsPerMeter = 2835;
+    bi->biYPelsPerMeter = 2835;
+    bi->biClrUsed = 0;
+    bi->biClrImportant = 0;
+}
+
+// Write outfile's headers
+void write_bmp_headers(FILE *outptr, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi)
+{
+    // Write outfile's BITMAPFILEHEADER
+    fwrite(bf, sizeof(BITMAPFILEHEADER), 1, outptr);
+
+    // Write outfile's BITMAPINFOHEADER
+    fwrite(bi, sizeof(BITMAPINFOHEADER), 1, outptr);
+}
+
+// Write pixel rows, adding scanline padding
+void write_bmp_rows(FILE *outptr, int height, int width, RGBTRIPLE image[height][width])
+{
+    int padding = bmp_padding(width);
+
+    // Write new pixels to outfile
+    for (int i = 0; i < height; i++)
+    {
+        // Write row to outfile
+        fwrite(image[i], sizeof(RGBTRIPLE), width, outptr);
+
+        // Write padding at end of row
+        for (int k = 0; k < padding; k++)
+        {
+            fputc(0x00, outptr);
+        }
+    }
+}
+
+// Write headers and pixel rows to outfile, adding scanline padding
+void write_bmp(FILE *outptr, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi,
+               int height, int width, RGBTRIPLE image[height][width])
+{
+    write_bmp_headers(outptr, bf, bi);
+    write_bmp_rows(outptr, height, width, image);
+}
@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+#include "bmp.h"
+
+// Read infile's headers and check it is a 24-bit uncompressed BMP 4.0
+// Returns 0 on success, 1 if the file format is unsupported
+int read_bmp_headers(FILE *inptr, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi);
+
+// Read pixel rows into image, skipping scanline padding
+void read_bmp_pixels(FILE *inptr, int height, int width, RGBTRIPLE image[height][width]);
+
+// Fill in headers for a new top-down 24-bit uncompressed BMP
+void init_bmp_headers(int height, int width, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi);
+
+// Write just the headers, for callers writing the rows in bands
+void write_bmp_headers(FILE *outptr, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi);
+
+// Write height pixel rows, adding scanline padding
+void write_bmp_rows(FILE *outptr, int height, int width, RGBTRIPLE image[height][width]);
+
+// Write headers and pixel rows to outfile, adding scanline padding
+void write_bmp(FILE *outptr, BITMAPFILEHEADER *bf, BITMAPINFOHEADER *bi,
+               int height, int width, RGBTRIPLE image[height][width]);
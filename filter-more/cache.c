@@ -0,0 +1,537 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "cache.h"
+
+// XXH64 primes
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+// A cached result in the memory tier
+struct CacheEntry
+{
+    uint64_t key;
+    size_t size;
+    void *data;
+    CacheEntry *newer, *older;  // Recency list
+    CacheEntry *next;           // Hash bucket chain
+};
+
+// A result file in the disk tier, for eviction
+typedef struct
+{
+    char name[17];
+    off_t size;
+    struct timespec mtime;
+} CacheFile;
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+// XXH64: hashes 32 bytes per step, so it runs at close to memory speed
+static uint64_t xxh64(const void *input, size_t len, uint64_t seed)
+{
+    const unsigned char *p = input;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        do
+        {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= end - 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else
+    {
+        h = seed + PRIME5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl64(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= *p * PRIME5;
+        h = rotl64(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Hash pixel data together with everything else that decides a filter's output
+uint64_t hash_filter_request(const void *pixels, size_t size, int height, int width,
+                             const char *filter, const char *params)
+{
+    // Hash the request description first and use it to seed the pixel hash
+    char desc[256];
+    int len = snprintf(desc, sizeof(desc), "%s|%s|%d|%d", filter, params, height, width);
+    if (len >= (int)sizeof(desc))
+    {
+        len = sizeof(desc) - 1;
+    }
+    return xxh64(pixels, size, xxh64(desc, len, 0));
+}
+
+// Create a memory cache holding at most max_bytes of results
+MemoryCache *memory_cache_new(size_t max_bytes)
+{
+    MemoryCache *cache = calloc(1, sizeof(MemoryCache));
+    if (!cache)
+    {
+        return NULL;
+    }
+    cache->n_buckets = 256;
+    cache->buckets = calloc(cache->n_buckets, sizeof(CacheEntry *));
+    if (!cache->buckets)
+    {
+        free(cache);
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+// Unlink an entry from the recency list
+static void unlink_entry(MemoryCache *cache, CacheEntry *entry)
+{
+    if (entry->newer)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        cache->newest = entry->older;
+    }
+    if (entry->older)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        cache->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+// Make an entry the most recently used one
+static void push_newest(MemoryCache *cache, CacheEntry *entry)
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest)
+    {
+        cache->newest->newer = entry;
+    }
+    cache->newest = entry;
+    if (!cache->oldest)
+    {
+        cache->oldest = entry;
+    }
+}
+
+// Remove an entry from its bucket and the recency list, then free it
+static void remove_entry(MemoryCache *cache, CacheEntry *entry)
+{
+    CacheEntry **link = &cache->buckets[entry->key % cache->n_buckets];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    unlink_entry(cache, entry);
+    cache->bytes -= entry->size;
+    free(entry->data);
+    free(entry);
+}
+
+// Look up a result of size bytes
+const void *memory_cache_get(MemoryCache *cache, uint64_t key, size_t size)
+{
+    for (CacheEntry *entry = cache->buckets[key % cache->n_buckets]; entry; entry = entry->next)
+    {
+        if (entry->key == key && entry->size == size)
+        {
+            unlink_entry(cache, entry);
+            push_newest(cache, entry);
+            cache->hits++;
+            return entry->data;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+// Store a copy of a result, evicting the least recently used ones to make room
+void memory_cache_put(MemoryCache *cache, uint64_t key, const void *data, size_t size)
+{
+    if (size > cache->max_bytes)
+    {
+        return;
+    }
+
+    // Replace any existing result for this key
+    for (CacheEntry *entry = cache->buckets[key % cache->n_buckets]; entry; entry = entry->next)
+    {
+        if (entry->key == key)
+        {
+            remove_entry(cache, entry);
+            break;
+        }
+    }
+
+    while (cache->oldest && cache->bytes + size > cache->max_bytes)
+    {
+        remove_entry(cache, cache->oldest);
+    }
+
+    CacheEntry *entry = malloc(sizeof(CacheEntry));
+    void *copy = malloc(size);
+    if (!entry || !copy)
+    {
+        free(entry);
+        free(copy);
+        return;
+    }
+    memcpy(copy, data, size);
+    entry->key = key;
+    entry->size = size;
+    entry->data = copy;
+    entry->next = cache->buckets[key % cache->n_buckets];
+    cache->buckets[key % cache->n_buckets] = entry;
+    push_newest(cache, entry);
+    cache->bytes += size;
+}
+
+// Free the cache and every entry in it
+void memory_cache_free(MemoryCache *cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+    while (cache->oldest)
+    {
+        remove_entry(cache, cache->oldest);
+    }
+    free(cache->buckets);
+    free(cache);
+}
+
+// Build the path of a file in the cache directory
+static void cache_path(DiskCache *cache, const char *name, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%s", cache->dir, name);
+}
+
+// Parse the totals from an open stats file, 0 if it is empty or unreadable
+static void parse_stats(int fd, unsigned long *hits, unsigned long *misses)
+{
+    char text[64];
+    ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+    text[n > 0 ? n : 0] = '\0';
+    if (sscanf(text, "hits %lu misses %lu", hits, misses) != 2)
+    {
+        *hits = *misses = 0;
+    }
+}
+
+// Read the totals from the stats file, 0 if there is none yet
+// Writers hold an exclusive lock while they update it in place
+static void read_stats(DiskCache *cache, unsigned long *hits, unsigned long *misses)
+{
+    char path[4096];
+    cache_path(cache, "stats", path, sizeof(path));
+
+    *hits = *misses = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        if (flock(fd, LOCK_SH) == 0)
+        {
+            parse_stats(fd, hits, misses);
+        }
+        close(fd);
+    }
+}
+
+// Open (creating if needed) a cache directory
+DiskCache *disk_cache_open(const char *dir, size_t max_bytes)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0)
+    {
+        if (mkdir(dir, 0755) != 0)
+        {
+            return NULL;
+        }
+    }
+    else if (!S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+
+    DiskCache *cache = calloc(1, sizeof(DiskCache));
+    if (!cache)
+    {
+        return NULL;
+    }
+    cache->dir = strdup(dir);
+    cache->max_bytes = max_bytes;
+    if (!cache->dir)
+    {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+// Read a result of size bytes into data
+int disk_cache_get(DiskCache *cache, uint64_t key, void *data, size_t size)
+{
+    char name[17], path[4096];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    cache_path(cache, name, path, sizeof(path));
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        cache->misses++;
+        return 1;
+    }
+
+    // A short or oversized file is not the result we are after; read into a
+    // scratch buffer so a bad file never clobbers data
+    struct stat st;
+    void *buffer = NULL;
+    int ok = fstat(fileno(f), &st) == 0 && (size_t)st.st_size == size &&
+             (buffer = malloc(size)) != NULL && fread(buffer, 1, size, f) == size;
+    fclose(f);
+    if (!ok)
+    {
+        free(buffer);
+        cache->misses++;
+        return 1;
+    }
+    memcpy(data, buffer, size);
+    free(buffer);
+
+    // Touch the file so eviction sees it as recently used
+    utime(path, NULL);
+    cache->hits++;
+    return 0;
+}
+
+// Oldest files first
+static int compare_mtime(const void *a, const void *b)
+{
+    const CacheFile *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+    {
+        return (x->mtime.tv_sec > y->mtime.tv_sec) - (x->mtime.tv_sec < y->mtime.tv_sec);
+    }
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+// Delete the least recently used result files until the total fits the cap
+static void evict_files(DiskCache *cache)
+{
+    DIR *dir = opendir(cache->dir);
+    if (!dir)
+    {
+        return;
+    }
+
+    CacheFile *files = NULL;
+    size_t n_files = 0, capacity = 0;
+    size_t total = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        // Result files are named by their 16-digit hex key
+        if (strlen(de->d_name) != 16 || strspn(de->d_name, "0123456789abcdef") != 16)
+        {
+            continue;
+        }
+
+        char path[4096];
+        struct stat st;
+        cache_path(cache, de->d_name, path, sizeof(path));
+        if (stat(path, &st) != 0)
+        {
+            continue;
+        }
+
+        if (n_files == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            CacheFile *grown = realloc(files, capacity * sizeof(CacheFile));
+            if (!grown)
+            {
+                break;
+            }
+            files = grown;
+        }
+        strcpy(files[n_files].name, de->d_name);
+        files[n_files].size = st.st_size;
+#ifdef __APPLE__
+        files[n_files].mtime = st.st_mtimespec;
+#else
+        files[n_files].mtime = st.st_mtim;
+#endif
+        n_files++;
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    if (total > cache->max_bytes)
+    {
+        qsort(files, n_files, sizeof(CacheFile), compare_mtime);
+        for (size_t i = 0; i < n_files && total > cache->max_bytes; i++)
+        {
+            char path[4096];
+            cache_path(cache, files[i].name, path, sizeof(path));
+            if (unlink(path) == 0)
+            {
+                total -= files[i].size;
+            }
+        }
+    }
+    free(files);
+}
+
+// Store a result, then evict the least recently used files over the size cap
+void disk_cache_put(DiskCache *cache, uint64_t key, const void *data, size_t size)
+{
+    if (size > cache->max_bytes)
+    {
+        return;
+    }
+
+    char name[17], path[4096], tmp[4096 + 32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+    cache_path(cache, name, path, sizeof(path));
+
+    // Write to a private file and rename it into place, so concurrent runs
+    // never see a partly written result
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        return;
+    }
+    int ok = fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return;
+    }
+
+    evict_files(cache);
+}
+
+// Hit and miss totals across runs, including this one
+void disk_cache_stats(DiskCache *cache, unsigned long *hits, unsigned long *misses)
+{
+    read_stats(cache, hits, misses);
+    *hits += cache->hits;
+    *misses += cache->misses;
+}
+
+// Add this run's counts to the directory's totals and close the cache
+void disk_cache_close(DiskCache *cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+
+    // Read, add and write back under one lock, so concurrent runs never lose counts
+    char path[4096];
+    cache_path(cache, "stats", path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0)
+    {
+        if (flock(fd, LOCK_EX) == 0)
+        {
+            unsigned long hits, misses;
+            parse_stats(fd, &hits, &misses);
+            char text[64];
+            int len = snprintf(text, sizeof(text), "hits %lu misses %lu\n", hits + cache->hits, misses + cache->misses);
+
+            // Totals only grow, so the new line always covers the old one
+            pwrite(fd, text, len, 0);
+        }
+        close(fd);
+    }
+
+    free(cache->dir);
+    free(cache);
+}
@@ -0,0 +1,56 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Hash pixel data together with everything else that decides a filter's output
+// params describes filter settings, "" when the filter has none
+uint64_t hash_filter_request(const void *pixels, size_t size, int height, int width,
+                             const char *filter, const char *params);
+
+// In-memory LRU cache of filter results, bounded by total bytes
+typedef struct CacheEntry CacheEntry;
+typedef struct
+{
+    CacheEntry **buckets;
+    size_t n_buckets;
+    CacheEntry *newest, *oldest;
+    size_t bytes, max_bytes;
+    unsigned long hits, misses;
+} MemoryCache;
+
+// Create a memory cache holding at most max_bytes of results, or NULL
+MemoryCache *memory_cache_new(size_t max_bytes);
+
+// Look up a result of size bytes; the pointer stays valid until the next put
+// Returns NULL on a miss
+const void *memory_cache_get(MemoryCache *cache, uint64_t key, size_t size);
+
+// Store a copy of a result, evicting the least recently used ones to make room
+void memory_cache_put(MemoryCache *cache, uint64_t key, const void *data, size_t size);
+
+// Free the cache and every entry in it
+void memory_cache_free(MemoryCache *cache);
+
+// On-disk cache of filter results in one directory, bounded by total bytes
+// Hit and miss counts accumulate across runs in the directory's "stats" file
+typedef struct
+{
+    char *dir;
+    size_t max_bytes;
+    unsigned long hits, misses;  // This run only
+} DiskCache;
+
+// Open (creating if needed) a cache directory, or return NULL
+DiskCache *disk_cache_open(const char *dir, size_t max_bytes);
+
+// Read a result of size bytes into data, which is left alone on a miss
+// Returns 0 on a hit, 1 on a miss
+int disk_cache_get(DiskCache *cache, uint64_t key, void *data, size_t size);
+
+// Store a result, then evict the least recently used files over the size cap
+void disk_cache_put(DiskCache *cache, uint64_t key, const void *data, size_t size);
+
+// Hit and miss totals across runs, including this one
+void disk_cache_stats(DiskCache *cache, unsigned long *hits, unsigned long *misses);
+
+// Add this run's counts to the directory's totals and close the cache
+void disk_cache_close(DiskCache *cache);
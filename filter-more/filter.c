@@ -2,8 +2,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "bmpio.h"
+#include "cache.h"
 #include "helpers.h"
 
+// Default size cap of the on-disk result cache, in megabytes
+#define FILTER_CACHE_MAX_MB 256
+
 int main(int argc, char *argv[])
 {
     // Define allowable filters
@@ -52,17 +57,10 @@ int main(int argc, char *argv[])
         return 5;
     }
 
-    // Read infile's BITMAPFILEHEADER
+    // Read infile's headers and ensure infile is (likely) a 24-bit uncompressed BMP 4.0
     BITMAPFILEHEADER bf;
-    fread(&bf, sizeof(BITMAPFILEHEADER), 1, inptr);
-
-    // Read infile's BITMAPINFOHEADER
     BITMAPINFOHEADER bi;
-    fread(&bi, sizeof(BITMAPINFOHEADER), 1, inptr);
-
-    // Ensure infile is (likely) a 24-bit uncompressed BMP 4.0
-    if (bf.bfType != 0x4d42 || bf.bfOffBits != 54 || bi.biSize != 40 ||
-        bi.biBitCount != 24 || bi.biCompression != 0)
+    if (read_bmp_headers(inptr, &bf, &bi) != 0)
     {
         fclose(outptr);
         fclose(inptr);
@@ -75,71 +73,88 @@ int main(int argc, char *argv[])
     int width = bi.biWidth;
 
     // Allocate memory for image
+    // Blur and edges also need room for a copy of it
     RGBTRIPLE(*image)[width] = calloc(height, width * sizeof(RGBTRIPLE));
-    if (image == NULL)
+    if (image == NULL || ((filter == 'b' || filter == 'e') && filter_scratch_reserve((size_t)height * width) != 0))
     {
+        free(image);
         printf("Not enough memory to store image.\n");
         fclose(outptr);
         fclose(inptr);
         return 7;
     }
 
-    // Determine padding for scanlines
-    int padding = (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
+    // Read infile's pixels
+    read_bmp_pixels(inptr, height, width, image);
 
-    // Iterate over infile's scanlines
-    for (int i = 0; i < height; i++)
+    // Look the result up in the cache when $FILTER_CACHE_DIR is set
+    DiskCache *cache = NULL;
+    uint64_t key = 0;
+    int cached = 0;
+    size_t size = (size_t)height * width * sizeof(RGBTRIPLE);
+    char *cache_dir = getenv("FILTER_CACHE_DIR");
+    if (cache_dir && cache_dir[0])
     {
-        // Read row into pixel array
-        fread(image[i], sizeof(RGBTRIPLE), width, inptr);
+        // Cap the cache at $FILTER_CACHE_MAX_MB megabytes
+        char *max_mb = getenv("FILTER_CACHE_MAX_MB");
+        size_t max_bytes = (size_t)((max_mb && atol(max_mb) > 0) ? atol(max_mb) : FILTER_CACHE_MAX_MB) << 20;
 
-        // Skip over padding
-        fseek(inptr, padding, SEEK_CUR);
+        cache = disk_cache_open(cache_dir, max_bytes);
+        if (cache)
+        {
+            char filter_name[2] = {filter, '\0'};
+            key = hash_filter_request(image, size, height, width, filter_name, "");
+            cached = disk_cache_get(cache, key, image, size) == 0;
+        }
     }
 
     // Filter image
-    switch (filter)
+    if (!cached)
     {
-        // Blur
-        case 'b':
-            blur(height, width, image);
-            break;
-
-        // Edges
-        case 'e':
-            edges(height, width, image);
-            break;
-
-        // Grayscale
-        case 'g':
-            grayscale(height, width, image);
-            break;
-
-        // Reflect
-        case 'r':
-            reflect(height, width, image);
-            break;
-    }
-
-    // Write outfile's BITMAPFILEHEADER
-    fwrite(&bf, sizeof(BITMAPFILEHEADER), 1, outptr);
+        switch (filter)
+        {
+            // Blur
+            case 'b':
+                blur(height, width, image);
+                break;
+
+            // Edges
+            case 'e':
+                edges(height, width, image);
+                break;
+
+            // Grayscale
+            case 'g':
+                grayscale(height, width, image);
+                break;
+
+            // Reflect
+            case 'r':
+                reflect(height, width, image);
+                break;
+        }
 
-    // Write outfile's BITMAPINFOHEADER
-    fwrite(&bi, sizeof(BITMAPINFOHEADER), 1, outptr);
+        if (cache)
+        {
+            disk_cache_put(cache, key, image, size);
+        }
+    }
 
-    // Write new pixels to outfile
-    for (int i = 0; i < height; i++)
+    // Report cache totals when $FILTER_CACHE_STATS is set
+    if (cache)
     {
-        // Write row to outfile
-        fwrite(image[i], sizeof(RGBTRIPLE), width, outptr);
-
-        // Write padding at end of row
-        for (int k = 0; k < padding; k++)
+        if (getenv("FILTER_CACHE_STATS"))
         {
-            fputc(0x00, outptr);
+            unsigned long hits, misses;
+            disk_cache_stats(cache, &hits, &misses);
+            fprintf(stderr, "cache %s: %lu hits, %lu misses\n", cached ? "hit" : "miss", hits, misses);
         }
+        disk_cache_close(cache);
     }
 
+    // Write outfile
+    write_bmp(outptr, &bf, &bi, height, width, image);
+
     // Free memory for image
     free(image);
 
@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filterd.h"
+#include "helpers.h"
+
+// Most connections held open at once; further clients wait in the listen backlog
+#define MAX_CONNECTIONS 1024
+
+// Seconds a connection may sit between requests before it is dropped, unless -i says otherwise
+#define IDLE_TIMEOUT 30
+
+// Seconds a worker waits for a client to take a reply
+#define SEND_TIMEOUT 5
+
+// Seconds to stop accepting after running out of descriptors or memory
+#define ACCEPT_BACKOFF 0.1
+
+// Leased buffers come in power-of-two size classes from 64 KiB up to the
+// first class that holds FILTERD_MAX_PIXELS
+#define POOL_MIN_SHIFT 16
+#define POOL_CLASSES 11
+
+// Ready buffers kept per class, and the most memory all of them may take
+#define POOL_DEPTH 2
+#define POOL_MAX_BYTES ((size_t)256 << 20)
+
+// A shared memory buffer leased to one connection
+// Clients keep the fd, so a buffer is never handed to another connection
+typedef struct
+{
+    int fd;
+    void *pixels;
+    size_t capacity;
+} SharedBuffer;
+
+// Buffers made and faulted in ahead of time, that no client has seen yet
+// A lease takes one and the refill thread makes a replacement off the request path
+static SharedBuffer pool[POOL_CLASSES][POOL_DEPTH];
+static int pool_count[POOL_CLASSES];
+static int pool_wanted[POOL_CLASSES];  // Classes some client has leased
+static size_t pool_bytes = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_low = PTHREAD_COND_INITIALIZER;
+
+// One client connection
+// The event loop owns it while it waits for a request; a worker owns it while serving one
+typedef struct Connection
+{
+    int sock;
+    SharedBuffer buffer;
+    FilterdRequest req;
+    size_t got;          // Bytes of req received so far
+    double last_active;  // When the last request was answered or the connection opened
+    int busy;            // Queued or being served
+    int failed;          // Set by the worker when the reply could not be sent
+    struct Connection *next;
+} Connection;
+
+// Listening socket, owned by the event loop
+static int listen_sock = -1;
+
+// Open connections, touched only by the event loop
+static Connection *conns[MAX_CONNECTIONS];
+static int n_conns = 0;
+
+// Requests waiting for a worker, and connections handed back by workers
+static Connection *jobs_head = NULL, *jobs_tail = NULL;
+static Connection *done_head = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+// Workers write a byte here to wake the event loop
+static int wake_pipe[2] = {-1, -1};
+
+// Monotonic time in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Create and map a fresh, size-sealed buffer of size bytes,
+// touching every page first if prefault is set
+// Returns 0 on success, 1 on error
+static int create_buffer(SharedBuffer *buffer, size_t size, int prefault)
+{
+    buffer->fd = shared_buffer_create(size);
+    if (buffer->fd < 0)
+    {
+        return 1;
+    }
+    buffer->pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer->fd, 0);
+    if (buffer->pixels == MAP_FAILED)
+    {
+        close(buffer->fd);
+        buffer->fd = -1;
+        buffer->pixels = NULL;
+        return 1;
+    }
+    buffer->capacity = size;
+
+    if (prefault)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t offset = 0; offset < size; offset += page)
+        {
+            ((volatile char *)buffer->pixels)[offset] = 0;
+        }
+    }
+    return 0;
+}
+
+// Size class for a buffer of size bytes, or POOL_CLASSES if it is too large to pool
+static int size_class(size_t size)
+{
+    int class = 0;
+    while (class < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + class)) < size)
+    {
+        class++;
+    }
+    return class;
+}
+
+// Lease a buffer of at least size bytes, from the pool when one is ready
+// Returns 0 on success, 1 on error
+static int lease_buffer(SharedBuffer *buffer, size_t size)
+{
+    int class = size_class(size);
+    if (class == POOL_CLASSES)
+    {
+        return create_buffer(buffer, size, 0);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_wanted[class] = 1;
+    int ready = pool_count[class] > 0;
+    if (ready)
+    {
+        *buffer = pool[class][--pool_count[class]];
+        pool_bytes -= buffer->capacity;
+    }
+    pthread_cond_signal(&pool_low);
+    pthread_mutex_unlock(&pool_lock);
+
+    // A cold start for this size: make one now and let the pool catch up
+    return ready ? 0 : create_buffer(buffer, (size_t)1 << (POOL_MIN_SHIFT + class), 0);
+}
+
+// Refill thread: keep every class clients use stocked, within the memory cap
+static void *refill_pool(void *arg)
+{
+#ifdef SCHED_IDLE
+    // Only use CPU time no request wants, so refilling never slows a running filter
+    struct sched_param param = {.sched_priority = 0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool_lock);
+        int class = -1;
+        while (class < 0)
+        {
+            for (int i = 0; i < POOL_CLASSES && class < 0; i++)
+            {
+                size_t size = (size_t)1 << (POOL_MIN_SHIFT + i);
+                if (pool_wanted[i] && pool_count[i] < POOL_DEPTH && pool_bytes + size <= POOL_MAX_BYTES)
+                {
+                    class = i;
+                }
+            }
+            if (class < 0)
+            {
+                pthread_cond_wait(&pool_low, &pool_lock);
+            }
+        }
+        size_t size = (size_t)1 << (POOL_MIN_SHIFT + class);
+        pool_bytes += size;
+        pthread_mutex_unlock(&pool_lock);
+
+        SharedBuffer buffer;
+        int failed = create_buffer(&buffer, size, 1);
+
+        pthread_mutex_lock(&pool_lock);
+        if (failed)
+        {
+            // Stop refilling this class until a client asks for it again
+            pool_bytes -= size;
+            pool_wanted[class] = 0;
+        }
+        else
+        {
+            pool[class][pool_count[class]++] = buffer;
+        }
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+// Unmap and close a buffer; the client's copy of the fd keeps its own pages alive
+static void release_buffer(SharedBuffer *buffer)
+{
+    if (buffer->pixels)
+    {
+        munmap(buffer->pixels, buffer->capacity);
+        close(buffer->fd);
+    }
+    buffer->fd = -1;
+    buffer->pixels = NULL;
+    buffer->capacity = 0;
+}
+
+// Check the buffer still has its full size before touching it
+// Linux seals the size; elsewhere this is the best we can do
+static int buffer_intact(SharedBuffer *buffer)
+{
+    struct stat st;
+    return fstat(buffer->fd, &st) == 0 && (size_t)st.st_size >= buffer->capacity;
+}
+
+// Apply filter in place, returns a FILTERD_* status
+static int run_filter(char filter, int height, int width, RGBTRIPLE image[height][width])
+{
+    // Blur and edges copy the image into this worker's scratch buffer, which
+    // stays allocated and faulted in for the next request
+    if ((filter == 'b' || filter == 'e') && filter_scratch_reserve((size_t)height * width) != 0)
+    {
+        return FILTERD_NO_MEMORY;
+    }
+
+    switch (filter)
+    {
+        // Blur
+        case 'b':
+            blur(height, width, image);
+            break;
+
+        // Edges
+        case 'e':
+            edges(height, width, image);
+            break;
+
+        // Grayscale
+        case 'g':
+            grayscale(height, width, image);
+            break;
+
+        // Reflect
+        case 'r':
+            reflect(height, width, image);
+            break;
+
+        default:
+            return FILTERD_BAD_REQUEST;
+    }
+    return FILTERD_OK;
+}
+
+// Read whatever part of the connection's next request has arrived, without blocking
+// Returns 1 once the request is complete, 0 if more is to come, -1 on hang-up or error
+static int read_request(Connection *conn)
+{
+    ssize_t n = recv(conn->sock, (char *)&conn->req + conn->got, sizeof(conn->req) - conn->got, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return 0;
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    conn->got += n;
+    return conn->got == sizeof(conn->req);
+}
+
+// Carry out one request on a worker thread, returns 0 to keep the connection
+static int serve(Connection *conn)
+{
+    FilterdRequest req = conn->req;
+    FilterdReply reply = {.status = FILTERD_OK, .capacity = 0};
+    int pass_fd = -1;
+
+    if (req.height <= 0 || req.width <= 0 ||
+        (int64_t)req.height * req.width > FILTERD_MAX_PIXELS)
+    {
+        reply.status = FILTERD_TOO_LARGE;
+    }
+    else if (req.type == FILTERD_LEASE)
+    {
+        // Always a buffer no client has seen: this one may still hold the old one
+        release_buffer(&conn->buffer);
+        if (lease_buffer(&conn->buffer, (size_t)req.height * req.width * sizeof(RGBTRIPLE)) == 0)
+        {
+            reply.capacity = conn->buffer.capacity;
+            pass_fd = conn->buffer.fd;
+        }
+        else
+        {
+            reply.status = FILTERD_NO_BUFFER;
+        }
+    }
+    else if (req.type == FILTERD_RUN)
+    {
+        if (!conn->buffer.pixels || (size_t)req.height * req.width * sizeof(RGBTRIPLE) > conn->buffer.capacity ||
+            !buffer_intact(&conn->buffer))
+        {
+            reply.status = FILTERD_NO_BUFFER;
+        }
+        else
+        {
+            reply.status = run_filter(req.filter, req.height, req.width, conn->buffer.pixels);
+            reply.capacity = conn->buffer.capacity;
+        }
+    }
+    else
+    {
+        reply.status = FILTERD_BAD_REQUEST;
+    }
+
+    return filterd_send(conn->sock, &reply, sizeof(reply), pass_fd);
+}
+
+// Worker loop: take complete requests off the queue and hand the connections back
+static void *worker(void *arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&queue_lock);
+        while (!jobs_head)
+        {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        Connection *conn = jobs_head;
+        jobs_head = conn->next;
+        if (!jobs_head)
+        {
+            jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        conn->failed = serve(conn) != 0;
+
+        // Back to the event loop, which owns every connection that is not being served
+        pthread_mutex_lock(&queue_lock);
+        conn->next = done_head;
+        done_head = conn;
+        pthread_mutex_unlock(&queue_lock);
+        char wake = 0;
+        while (write(wake_pipe[1], &wake, 1) < 0 && errno == EINTR)
+        {
+        }
+    }
+    return NULL;
+}
+
+// Queue a connection whose request is complete
+static void submit(Connection *conn)
+{
+    conn->busy = 1;
+    conn->next = NULL;
+    pthread_mutex_lock(&queue_lock);
+    if (jobs_tail)
+    {
+        jobs_tail->next = conn;
+    }
+    else
+    {
+        jobs_head = conn;
+    }
+    jobs_tail = conn;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Close a connection and drop it from the table
+static void drop_connection(int index)
+{
+    Connection *conn = conns[index];
+    release_buffer(&conn->buffer);
+    close(conn->sock);
+    free(conn);
+    conns[index] = conns[--n_conns];
+}
+
+// Accept every pending connection
+// Returns 0, or 1 when out of descriptors or memory and the caller should back off
+static int accept_connections(void)
+{
+    while (n_conns < MAX_CONNECTIONS)
+    {
+        int sock = accept(listen_sock, NULL, NULL);
+        if (sock < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            {
+                return 1;
+            }
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            {
+                continue;
+            }
+            // Anything else means the listening socket itself is broken
+            perror("filterd: accept");
+            exit(5);
+        }
+
+        // A client that stops reading its replies must not hold a worker forever
+        struct timeval timeout = {.tv_sec = SEND_TIMEOUT, .tv_usec = 0};
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn)
+        {
+            close(sock);
+            return 1;
+        }
+        conn->sock = sock;
+        conn->buffer.fd = -1;
+        conn->last_active = now();
+        conns[n_conns++] = conn;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int idle_timeout = IDLE_TIMEOUT;
+    const char *path = filterd_socket_path();
+
+    // Parse options
+    int opt;
+    while ((opt = getopt(argc, argv, "t:s:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+
+            case 's':
+                path = optarg;
+                break;
+
+            case 'i':
+                idle_timeout = atoi(optarg);
+                break;
+
+            default:
+                printf("Usage: ./filterd [-t threads] [-s socket] [-i idle-seconds]\n");
+                return 1;
+        }
+    }
+    if (n_threads < 1)
+    {
+        n_threads = 1;
+    }
+    if (idle_timeout < 1)
+    {
+        idle_timeout = 1;
+    }
+
+    // A client hanging up mid-reply must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path too long.\n");
+        return 2;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Replace any socket left behind by a previous run
+    unlink(path);
+    listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_sock < 0 || bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_sock, SOMAXCONN) != 0 || fcntl(listen_sock, F_SETFL, O_NONBLOCK) != 0)
+    {
+        printf("Could not listen on %s.\n", path);
+        return 3;
+    }
+    if (pipe(wake_pipe) != 0 || fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) != 0)
+    {
+        printf("Could not create wake-up pipe.\n");
+        return 3;
+    }
+
+    // Start the worker pool
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < n_threads; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, worker, NULL) != 0)
+        {
+            printf("Could not start worker threads.\n");
+            return 4;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // Start the thread that keeps the buffer pool stocked
+    pthread_t refill_tid;
+    if (pthread_create(&refill_tid, NULL, refill_pool, NULL) != 0)
+    {
+        printf("Could not start worker threads.\n");
+        return 4;
+    }
+    pthread_detach(refill_tid);
+
+    printf("filterd: %d workers listening on %s\n", n_threads, path);
+    fflush(stdout);
+
+    // Event loop: accept connections, gather requests and queue them for the workers,
+    // so an idle connection never ties up a worker
+    static struct pollfd fds[MAX_CONNECTIONS + 2];
+    static Connection *polled[MAX_CONNECTIONS];
+    double backoff_until = 0;
+    for (;;)
+    {
+        // Take back the connections workers have answered
+        pthread_mutex_lock(&queue_lock);
+        Connection *done = done_head;
+        done_head = NULL;
+        pthread_mutex_unlock(&queue_lock);
+        while (done)
+        {
+            Connection *next = done->next;
+            done->busy = 0;
+            done->got = 0;
+            done->last_active = now();
+            done = next;
+        }
+
+        // Drop connections that failed or have been idle too long
+        double t = now();
+        for (int i = n_conns - 1; i >= 0; i--)
+        {
+            if (!conns[i]->busy && (conns[i]->failed || t - conns[i]->last_active > idle_timeout))
+            {
+                drop_connection(i);
+            }
+        }
+
+        // Wait for the wake-up pipe, new connections, and requests on idle connections
+        int n_fds = 0, n_polled = 0;
+        fds[n_fds++] = (struct pollfd){.fd = wake_pipe[0], .events = POLLIN};
+        int listening = t >= backoff_until && n_conns < MAX_CONNECTIONS;
+        if (listening)
+        {
+            fds[n_fds++] = (struct pollfd){.fd = listen_sock, .events = POLLIN};
+        }
+        int first_conn = n_fds;
+        for (int i = 0; i < n_conns; i++)
+        {
+            if (!conns[i]->busy)
+            {
+                fds[n_fds++] = (struct pollfd){.fd = conns[i]->sock, .events = POLLIN};
+                polled[n_polled++] = conns[i];
+            }
+        }
+
+        // Wake at least once a second to expire idle connections and end a back-off
+        if (poll(fds, n_fds, 1000) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("filterd: poll");
+            return 5;
+        }
+
+        if (fds[0].revents)
+        {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+        if (listening && fds[1].revents && accept_connections() != 0)
+        {
+            backoff_until = now() + ACCEPT_BACKOFF;
+        }
+        for (int i = 0; i < n_polled; i++)
+        {
+            if (!fds[first_conn + i].revents)
+            {
+                continue;
+            }
+            Connection *conn = polled[i];
+            int ret = read_request(conn);
+            if (ret < 0)
+            {
+                conn->failed = 1;
+            }
+            else if (ret > 0)
+            {
+                submit(conn);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Default path of the daemon's Unix domain socket, overridden by $FILTERD_SOCKET
+#define FILTERD_SOCKET "/tmp/filterd.sock"
+
+// Largest image the daemon will filter, in pixels
+#define FILTERD_MAX_PIXELS (4096 * 4096)
+
+// How clients map a leased buffer: the daemon faults its pages in ahead of time,
+// so map them all at once rather than one page fault at a time
+#ifdef MAP_POPULATE
+#define FILTERD_MAP_FLAGS (MAP_SHARED | MAP_POPULATE)
+#else
+#define FILTERD_MAP_FLAGS MAP_SHARED
+#endif
+
+// Request types
+enum
+{
+    FILTERD_LEASE = 1,  // Ask for a shared buffer of at least height * width pixels
+    FILTERD_RUN = 2     // Filter the leased buffer in place
+};
+
+// Reply status codes
+enum
+{
+    FILTERD_OK = 0,
+    FILTERD_BAD_REQUEST = 1,
+    FILTERD_TOO_LARGE = 2,
+    FILTERD_NO_BUFFER = 3,
+    FILTERD_NO_MEMORY = 4
+};
+
+// Fixed-size request sent from client to daemon
+typedef struct
+{
+    int32_t type;    // FILTERD_LEASE or FILTERD_RUN
+    int32_t filter;  // Filter flag, same letters as ./filter
+    int32_t height;
+    int32_t width;
+} FilterdRequest;
+
+// Fixed-size reply sent from daemon to client
+// A successful FILTERD_LEASE reply carries the buffer's file descriptor
+typedef struct
+{
+    int32_t status;
+    uint32_t capacity;  // Size of the leased buffer in bytes
+} FilterdReply;
+
+// Resolve the socket path from the environment or the default
+const char *filterd_socket_path(void);
+
+// Connect to the daemon, returns the socket or -1
+int filterd_connect(const char *path);
+
+// Send a fixed-size message, optionally passing fd (-1 for none)
+// Returns 0 on success, -1 on error
+int filterd_send(int sock, const void *msg, size_t len, int fd);
+
+// Receive a fixed-size message, storing a passed descriptor in *fd if given
+// Returns 0 on success, -1 on error or end of stream
+int filterd_recv(int sock, void *msg, size_t len, int *fd);
+
+// Create an anonymous shared memory object of size bytes, returns its fd or -1
+// On Linux its size is sealed, so holders of the fd cannot shrink or grow it
+int shared_buffer_create(size_t size);
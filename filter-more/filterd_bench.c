@@ -0,0 +1,294 @@
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bmpio.h"
+#include "filterd.h"
+
+// Work and results for one load generating connection
+typedef struct
+{
+    int requests;
+    double *latencies;  // Seconds per request
+    int completed;
+    int status;         // Why it stopped early: a FILTERD_* status, or -1 if the daemon went away
+} BenchClient;
+
+// Image every client submits
+static int height, width;
+static RGBTRIPLE *source;
+static char filter = 'b';
+
+// Open a new connection for every request instead of one per client
+static int reconnect = 0;
+
+// Monotonic time in seconds
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Sort helper for latencies
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Describe a reply status for the report
+static const char *status_name(int status)
+{
+    switch (status)
+    {
+        case FILTERD_BAD_REQUEST:
+            return "bad request";
+
+        case FILTERD_TOO_LARGE:
+            return "image too large";
+
+        case FILTERD_NO_BUFFER:
+            return "no buffer";
+
+        case FILTERD_NO_MEMORY:
+            return "out of memory";
+
+        default:
+            return "unknown status";
+    }
+}
+
+// Connect and lease a buffer mapped at *pixels
+// Returns FILTERD_OK, the daemon's refusal, or -1 if it could not be reached
+static int open_session(int *sock, void **pixels)
+{
+    size_t size = (size_t)height * width * sizeof(RGBTRIPLE);
+
+    *sock = filterd_connect(filterd_socket_path());
+    if (*sock < 0)
+    {
+        return -1;
+    }
+
+    FilterdRequest req = {.type = FILTERD_LEASE, .filter = filter, .height = height, .width = width};
+    FilterdReply reply;
+    int fd = -1;
+    if (filterd_send(*sock, &req, sizeof(req), -1) != 0 ||
+        filterd_recv(*sock, &reply, sizeof(reply), &fd) != 0)
+    {
+        close(*sock);
+        return -1;
+    }
+
+    *pixels = MAP_FAILED;
+    if (reply.status == FILTERD_OK && fd >= 0 && reply.capacity >= size)
+    {
+        *pixels = mmap(NULL, size, PROT_READ | PROT_WRITE, FILTERD_MAP_FLAGS, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (*pixels == MAP_FAILED)
+    {
+        close(*sock);
+        return reply.status != FILTERD_OK ? reply.status : FILTERD_NO_BUFFER;
+    }
+    return FILTERD_OK;
+}
+
+// One load generating client: submit jobs back to back
+static void *run_client(void *arg)
+{
+    BenchClient *client = arg;
+    size_t size = (size_t)height * width * sizeof(RGBTRIPLE);
+    int sock = -1;
+    void *pixels = NULL;
+
+    FilterdRequest req = {.type = FILTERD_RUN, .filter = filter, .height = height, .width = width};
+    FilterdReply reply;
+    for (int i = 0; i < client->requests; i++)
+    {
+        // Time from connecting and leasing, when this request needs a connection,
+        // through handing over fresh pixels to getting the result back
+        double start = now();
+        if (sock < 0)
+        {
+            client->status = open_session(&sock, &pixels);
+            if (client->status != FILTERD_OK)
+            {
+                sock = -1;
+                break;
+            }
+        }
+
+        memcpy(pixels, source, size);
+        if (filterd_send(sock, &req, sizeof(req), -1) != 0 ||
+            filterd_recv(sock, &reply, sizeof(reply), NULL) != 0)
+        {
+            client->status = -1;
+            break;
+        }
+        if (reply.status != FILTERD_OK)
+        {
+            client->status = reply.status;
+            break;
+        }
+
+        if (reconnect)
+        {
+            munmap(pixels, size);
+            close(sock);
+            sock = -1;
+        }
+        client->latencies[client->completed++] = now() - start;
+    }
+
+    if (sock >= 0)
+    {
+        munmap(pixels, size);
+        close(sock);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int n_requests = 1000;
+    int n_clients = 4;
+
+    // Parse options
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:f:r")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                n_requests = atoi(optarg);
+                break;
+
+            case 'c':
+                n_clients = atoi(optarg);
+                break;
+
+            case 'f':
+                filter = optarg[0];
+                break;
+
+            case 'r':
+                reconnect = 1;
+                break;
+
+            default:
+                n_requests = 0;
+                break;
+        }
+    }
+    if (argc != optind + 1 || n_requests < 1 || n_clients < 1)
+    {
+        printf("Usage: ./filterd-bench [-n requests] [-c clients] [-f flag] [-r] infile\n");
+        return 1;
+    }
+
+    // Load the image once
+    char *infile = argv[optind];
+    FILE *inptr = fopen(infile, "r");
+    if (inptr == NULL)
+    {
+        printf("Could not open %s.\n", infile);
+        return 2;
+    }
+    BITMAPFILEHEADER bf;
+    BITMAPINFOHEADER bi;
+    if (read_bmp_headers(inptr, &bf, &bi) != 0)
+    {
+        fclose(inptr);
+        printf("Unsupported file format.\n");
+        return 3;
+    }
+    height = abs(bi.biHeight);
+    width = bi.biWidth;
+    source = calloc((size_t)height * width, sizeof(RGBTRIPLE));
+    double *latencies = calloc(n_requests, sizeof(double));
+    BenchClient *clients = calloc(n_clients, sizeof(BenchClient));
+    pthread_t *threads = calloc(n_clients, sizeof(pthread_t));
+    if (!source || !latencies || !clients || !threads)
+    {
+        printf("Not enough memory.\n");
+        fclose(inptr);
+        return 4;
+    }
+    read_bmp_pixels(inptr, height, width, (RGBTRIPLE(*)[width])source);
+    fclose(inptr);
+
+    // Split the requests across connections
+    double *next = latencies;
+    for (int i = 0; i < n_clients; i++)
+    {
+        clients[i].requests = n_requests / n_clients + (i < n_requests % n_clients);
+        clients[i].latencies = next;
+        next += clients[i].requests;
+    }
+
+    double start = now();
+    for (int i = 0; i < n_clients; i++)
+    {
+        pthread_create(&threads[i], NULL, run_client, &clients[i]);
+    }
+    for (int i = 0; i < n_clients; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // Gather the completed requests into one sorted run, and any reason a client stopped early
+    int completed = 0;
+    int unreachable = 0, refused = FILTERD_OK;
+    for (int i = 0; i < n_clients; i++)
+    {
+        memmove(latencies + completed, clients[i].latencies, clients[i].completed * sizeof(double));
+        completed += clients[i].completed;
+        if (clients[i].status < 0)
+        {
+            unreachable = 1;
+        }
+        else if (clients[i].status != FILTERD_OK)
+        {
+            refused = clients[i].status;
+        }
+    }
+
+    int status = 0;
+    if (refused != FILTERD_OK)
+    {
+        printf("filterd refused requests: status %d (%s)\n", refused, status_name(refused));
+        status = 5;
+    }
+    if (unreachable)
+    {
+        printf("Could not reach filterd; is it running?\n");
+        status = 5;
+    }
+    if (completed > 0)
+    {
+        qsort(latencies, completed, sizeof(double), compare_doubles);
+        printf("%d x %d image, filter '%c', %d clients%s\n", width, height, filter, n_clients,
+               reconnect ? ", reconnecting for every request" : "");
+        printf("requests: %d/%d completed in %.3f s\n", completed, n_requests, elapsed);
+        printf("p50: %.3f ms\n", latencies[(completed - 1) / 2] * 1e3);
+        printf("p99: %.3f ms\n", latencies[(int)((completed - 1) * 0.99)] * 1e3);
+        printf("requests/sec: %.1f\n", completed / elapsed);
+    }
+
+    free(threads);
+    free(clients);
+    free(latencies);
+    free(source);
+    return status;
+}
@@ -0,0 +1,135 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "bmpio.h"
+#include "filterd.h"
+
+int main(int argc, char *argv[])
+{
+    // Define allowable filters
+    char *filters = "begr";
+
+    // Get filter flag and check validity
+    char filter = getopt(argc, argv, filters);
+    if (filter == '?')
+    {
+        printf("Invalid filter.\n");
+        return 1;
+    }
+
+    // Ensure only one filter
+    if (getopt(argc, argv, filters) != -1)
+    {
+        printf("Only one filter allowed.\n");
+        return 2;
+    }
+
+    // Ensure proper usage
+    if (argc != optind + 2)
+    {
+        printf("Usage: ./filterd-client [flag] infile outfile\n");
+        return 3;
+    }
+
+    // Remember filenames
+    char *infile = argv[optind];
+    char *outfile = argv[optind + 1];
+
+    // Open input file
+    FILE *inptr = fopen(infile, "r");
+    if (inptr == NULL)
+    {
+        printf("Could not open %s.\n", infile);
+        return 4;
+    }
+
+    // Read infile's headers and ensure infile is (likely) a 24-bit uncompressed BMP 4.0
+    BITMAPFILEHEADER bf;
+    BITMAPINFOHEADER bi;
+    if (read_bmp_headers(inptr, &bf, &bi) != 0)
+    {
+        fclose(inptr);
+        printf("Unsupported file format.\n");
+        return 6;
+    }
+
+    // Get image's dimensions
+    int height = abs(bi.biHeight);
+    int width = bi.biWidth;
+
+    // Connect to the daemon
+    const char *path = filterd_socket_path();
+    int sock = filterd_connect(path);
+    if (sock < 0)
+    {
+        fclose(inptr);
+        printf("Could not connect to filterd at %s.\n", path);
+        return 8;
+    }
+
+    // Lease a pre-faulted shared buffer from the daemon's pool
+    FilterdRequest req = {.type = FILTERD_LEASE, .filter = filter, .height = height, .width = width};
+    FilterdReply reply;
+    int fd = -1;
+    if (filterd_send(sock, &req, sizeof(req), -1) != 0 ||
+        filterd_recv(sock, &reply, sizeof(reply), &fd) != 0 ||
+        reply.status != FILTERD_OK || fd < 0)
+    {
+        printf("filterd refused the image.\n");
+        fclose(inptr);
+        close(sock);
+        return 9;
+    }
+
+    // Map only the pixels we need; the buffer may be larger
+    size_t size = (size_t)height * width * sizeof(RGBTRIPLE);
+    RGBTRIPLE(*image)[width] = MAP_FAILED;
+    if (reply.capacity >= size)
+    {
+        image = mmap(NULL, size, PROT_READ | PROT_WRITE, FILTERD_MAP_FLAGS, fd, 0);
+    }
+    close(fd);
+    if (image == MAP_FAILED)
+    {
+        printf("Could not map shared buffer.\n");
+        fclose(inptr);
+        close(sock);
+        return 7;
+    }
+
+    // Read pixels straight into the shared buffer
+    read_bmp_pixels(inptr, height, width, image);
+    fclose(inptr);
+
+    // Filter image in the daemon
+    req.type = FILTERD_RUN;
+    if (filterd_send(sock, &req, sizeof(req), -1) != 0 ||
+        filterd_recv(sock, &reply, sizeof(reply), NULL) != 0 ||
+        reply.status != FILTERD_OK)
+    {
+        printf("filterd could not filter the image.\n");
+        munmap(image, size);
+        close(sock);
+        return 10;
+    }
+    close(sock);
+
+    // Open output file
+    FILE *outptr = fopen(outfile, "w");
+    if (outptr == NULL)
+    {
+        munmap(image, size);
+        printf("Could not create %s.\n", outfile);
+        return 5;
+    }
+
+    // Write outfile from the shared buffer
+    write_bmp(outptr, &bf, &bi, height, width, image);
+
+    munmap(image, size);
+    fclose(outptr);
+    return 0;
+}
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "filterd.h"
+
+// Resolve the socket path from the environment or the default
+const char *filterd_socket_path(void)
+{
+    const char *path = getenv("FILTERD_SOCKET");
+    return (path && path[0]) ? path : FILTERD_SOCKET;
+}
+
+// Connect to the daemon, returns the socket or -1
+int filterd_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Send a fixed-size message, optionally passing fd (-1 for none)
+int filterd_send(int sock, const void *msg, size_t len, int fd)
+{
+    struct iovec iov = {.iov_base = (void *)msg, .iov_len = len};
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    // Ancillary buffer for one SCM_RIGHTS descriptor
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    if (fd >= 0)
+    {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    // Messages are tiny, but still finish a short write on the stream
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = sendmsg(sock, &mh, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        sent += n;
+        iov.iov_base = (char *)msg + sent;
+        iov.iov_len = len - sent;
+        mh.msg_control = NULL;
+        mh.msg_controllen = 0;
+    }
+    return 0;
+}
+
+// Receive a fixed-size message, storing a passed descriptor in *fd if given
+int filterd_recv(int sock, void *msg, size_t len, int *fd)
+{
+    if (fd)
+    {
+        *fd = -1;
+    }
+
+    size_t got = 0;
+    while (got < len)
+    {
+        struct iovec iov = {.iov_base = (char *)msg + got, .iov_len = len - got};
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+
+        union
+        {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(sock, &mh, 0);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (fd && *fd >= 0)
+            {
+                close(*fd);
+                *fd = -1;
+            }
+            return -1;
+        }
+        got += n;
+
+        // Pick up a passed descriptor, closing any we were not asked for
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                int passed;
+                memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+                if (fd && *fd < 0)
+                {
+                    *fd = passed;
+                }
+                else
+                {
+                    close(passed);
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Create an anonymous shared memory object of size bytes, returns its fd or -1
+int shared_buffer_create(size_t size)
+{
+#ifdef __linux__
+    int fd = memfd_create("filterd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    // No memfd outside Linux: create a named object and unlink it straight away
+    static unsigned counter = 0;
+    char name[32];
+    snprintf(name, sizeof(name), "/filterd-%d-%u", (int)getpid(), __sync_fetch_and_add(&counter, 1));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        shm_unlink(name);
+    }
+#endif
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+#ifdef __linux__
+    // Fix the size for good: a client that could shrink the buffer would make
+    // the daemon fault on pages past the end
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+#endif
+    return fd;
+}
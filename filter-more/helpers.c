@@ -1,12 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "helpers.h"
 #include "math.h"
 
+// Kernel filters copy the pixels they read into this buffer
+// Each thread keeps its own and reuses it, so no filter needs a large stack
+static _Thread_local RGBTRIPLE *scratch = NULL;
+static _Thread_local size_t scratch_pixels = 0;
+
+// Clip a region to the image, returns 0 if nothing is left
+int clip_roi(int height, int width, ROI *roi)
+{
+    int bottom = roi->top + roi->height;
+    int right = roi->left + roi->width;
+    if (roi->top < 0) roi->top = 0;
+    if (roi->left < 0) roi->left = 0;
+    if (bottom > height) bottom = height;
+    if (right > width) right = width;
+    roi->height = bottom - roi->top;
+    roi->width = right - roi->left;
+    return roi->height > 0 && roi->width > 0;
+}
+
+// The region grown by the 1-pixel border a 3x3 kernel reads, clipped to the image
+ROI kernel_window(int height, int width, ROI roi)
+{
+    ROI window = {roi.top - 1, roi.left - 1, roi.height + 2, roi.width + 2};
+    clip_roi(height, width, &window);
+    return window;
+}
+
+// Make sure this thread's scratch buffer holds at least pixels pixels
+int filter_scratch_reserve(size_t pixels)
+{
+    if (pixels <= scratch_pixels)
+    {
+        return 0;
+    }
+    RGBTRIPLE *grown = malloc(pixels * sizeof(RGBTRIPLE));
+    if (!grown)
+    {
+        return 1;
+    }
+
+    // Fault the pages in now rather than in the middle of a filter
+    memset(grown, 0, pixels * sizeof(RGBTRIPLE));
+    free(scratch);
+    scratch = grown;
+    scratch_pixels = pixels;
+    return 0;
+}
+
+// Copy a window of the image into the scratch buffer
+// Returns the copy, window.height rows of window.width pixels, or NULL if out of memory
+static void *copy_window(int height, int width, RGBTRIPLE image[height][width], ROI window)
+{
+    if (filter_scratch_reserve((size_t)window.height * window.width) != 0)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < window.height; i++)
+    {
+        memcpy(scratch + (size_t)i * window.width, &image[window.top + i][window.left],
+               window.width * sizeof(RGBTRIPLE));
+    }
+    return scratch;
+}
+
 // Convert image to grayscale
 void grayscale(int height, int width, RGBTRIPLE image[height][width])
-{   
-    for (int i = 0; i < height; i++)
+{
+    grayscale_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Convert a region to grayscale
+void grayscale_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
     {
-        for (int j = 0; j < width; j++)
+        return;
+    }
+
+    for (int i = roi.top; i < roi.top + roi.height; i++)
+    {
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             // Calculate the average of the RGB values
             int red = image[i][j].rgbtRed;
@@ -25,16 +103,29 @@ void grayscale(int height, int width, RGBTRIPLE image[height][width])
 
 // Reflect image horizontally
 void reflect(int height, int width, RGBTRIPLE image[height][width])
-{   
-    for (int i = 0; i < height; i++)
+{
+    reflect_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Reflect a region horizontally about its own centre
+void reflect_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
+    {
+        return;
+    }
+
+    for (int i = roi.top; i < roi.top + roi.height; i++)
     {
         // Loop only to the middle of the row
-        for (int j = 0; j < width / 2; j++)
+        for (int j = 0; j < roi.width / 2; j++)
         {
             // Use a temporary variable to swap pixels
-            RGBTRIPLE temp = image[i][j];
-            image[i][j] = image[i][width - 1 - j];
-            image[i][width - 1 - j] = temp;
+            int left = roi.left + j;
+            int right = roi.left + roi.width - 1 - j;
+            RGBTRIPLE temp = image[i][left];
+            image[i][left] = image[i][right];
+            image[i][right] = temp;
         }
     }
     return;
@@ -42,20 +133,29 @@ void reflect(int height, int width, RGBTRIPLE image[height][width])
 
 // Blur image
 void blur(int height, int width, RGBTRIPLE image[height][width])
-{   
-    // Create a temporary copy of the image
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+{
+    blur_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Blur a region, averaging in neighbours from outside it
+void blur_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
     {
-        for (int j = 0; j < width; j++)
-        {
-            temp[i][j] = image[i][j];
-        }
+        return;
     }
 
-    for (int i = 0; i < height; i++)
+    // Copy the region and its border, which the loop below overwrites
+    ROI window = kernel_window(height, width, roi);
+    RGBTRIPLE (*temp)[window.width] = copy_window(height, width, image, window);
+    if (!temp)
     {
-        for (int j = 0; j < width; j++)
+        return;
+    }
+
+    for (int i = roi.top; i < roi.top + roi.height; i++)
+    {
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             float totalRed = 0, totalGreen = 0, totalBlue = 0;
             int counter = 0;
@@ -71,9 +171,10 @@ void blur(int height, int width, RGBTRIPLE image[height][width])
                     // Check if the neighbor is within image bounds
                     if (new_i >= 0 && new_i < height && new_j >= 0 && new_j < width)
                     {
-                        totalRed += temp[new_i][new_j].rgbtRed;
-                        totalGreen += temp[new_i][new_j].rgbtGreen;
-                        totalBlue += temp[new_i][new_j].rgbtBlue;
+                        RGBTRIPLE *p = &temp[new_i - window.top][new_j - window.left];
+                        totalRed += p->rgbtRed;
+                        totalGreen += p->rgbtGreen;
+                        totalBlue += p->rgbtBlue;
                         counter++;
                     }
                 }
@@ -89,23 +190,32 @@ void blur(int height, int width, RGBTRIPLE image[height][width])
 
 // Detect edges
 void edges(int height, int width, RGBTRIPLE image[height][width])
-{   
-    // Create a temporary copy of the image
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+{
+    edges_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Detect edges in a region, reading neighbours from outside it
+void edges_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
     {
-        for (int j = 0; j < width; j++)
-        {
-            temp[i][j] = image[i][j];
-        }
+        return;
+    }
+
+    // Copy the region and its border, which the loop below overwrites
+    ROI window = kernel_window(height, width, roi);
+    RGBTRIPLE (*temp)[window.width] = copy_window(height, width, image, window);
+    if (!temp)
+    {
+        return;
     }
 
     int Gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
     int Gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
 
-    for (int i = 0; i < height; i++)
+    for (int i = roi.top; i < roi.top + roi.height; i++)
     {
-        for (int j = 0; j < width; j++)
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             float gxRed = 0, gyRed = 0;
             float gxGreen = 0, gyGreen = 0;
@@ -122,12 +232,13 @@ void edges(int height, int width, RGBTRIPLE image[height][width])
                     // Check boundaries
                     if (new_i >= 0 && new_i < height && new_j >= 0 && new_j < width)
                     {
-                        gxRed += temp[new_i][new_j].rgbtRed * Gx[di + 1][dj + 1];
-                        gyRed += temp[new_i][new_j].rgbtRed * Gy[di + 1][dj + 1];
-                        gxGreen += temp[new_i][new_j].rgbtGreen * Gx[di + 1][dj + 1];
-                        gyGreen += temp[new_i][new_j].rgbtGreen * Gy[di + 1][dj + 1];
-                        gxBlue += temp[new_i][new_j].rgbtBlue * Gx[di + 1][dj + 1];
-                        gyBlue += temp[new_i][new_j].rgbtBlue * Gy[di + 1][dj + 1];
+                        RGBTRIPLE *p = &temp[new_i - window.top][new_j - window.left];
+                        gxRed += p->rgbtRed * Gx[di + 1][dj + 1];
+                        gyRed += p->rgbtRed * Gy[di + 1][dj + 1];
+                        gxGreen += p->rgbtGreen * Gx[di + 1][dj + 1];
+                        gyGreen += p->rgbtGreen * Gy[di + 1][dj + 1];
+                        gxBlue += p->rgbtBlue * Gx[di + 1][dj + 1];
+                        gyBlue += p->rgbtBlue * Gy[di + 1][dj + 1];
                     }
                 }
             }
@@ -143,12 +254,24 @@ void edges(int height, int width, RGBTRIPLE image[height][width])
     }
     return;
 }
-// Detect edges
+
+// Sepia filter
 void sepia(int height, int width, RGBTRIPLE image[height][width])
-{   
-    for (int i = 0; i < height; i++)
+{
+    sepia_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Sepia filter on a region
+void sepia_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
     {
-        for (int j = 0; j < width; j++)
+        return;
+    }
+
+    for (int i = roi.top; i < roi.top + roi.height; i++)
+    {
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             int originalRed = image[i][j].rgbtRed;
             int originalGreen = image[i][j].rgbtGreen;
@@ -165,12 +288,24 @@ void sepia(int height, int width, RGBTRIPLE image[height][width])
     }
     return;
 }
-// Detect edges
+
+// Negative image
 void negative(int height, int width, RGBTRIPLE image[height][width])
 {
-    for (int i = 0; i < height; i++)
+    negative_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Negative of a region
+void negative_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
+    {
+        return;
+    }
+
+    for (int i = roi.top; i < roi.top + roi.height; i++)
     {
-        for (int j = 0; j < width; j++)
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             image[i][j].rgbtRed = 255 - image[i][j].rgbtRed;
             image[i][j].rgbtGreen = 255 - image[i][j].rgbtGreen;
@@ -183,14 +318,23 @@ void negative(int height, int width, RGBTRIPLE image[height][width])
 // Sharpen image
 void sharpen(int height, int width, RGBTRIPLE image[height][width])
 {
-    // Create a temporary copy of the image
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+    sharpen_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Sharpen a region, reading neighbours from outside it
+void sharpen_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
     {
-        for (int j = 0; j < width; j++)
-        {
-            temp[i][j] = image[i][j];
-        }
+        return;
+    }
+
+    // Copy the region and its border, which the loop below overwrites
+    ROI window = kernel_window(height, width, roi);
+    RGBTRIPLE (*temp)[window.width] = copy_window(height, width, image, window);
+    if (!temp)
+    {
+        return;
     }
 
     // Sharpening kernel
@@ -200,9 +344,9 @@ void sharpen(int height, int width, RGBTRIPLE image[height][width])
         {-1, -1, -1}
     };
 
-    for (int i = 0; i < height; i++)
+    for (int i = roi.top; i < roi.top + roi.height; i++)
     {
-        for (int j = 0; j < width; j++)
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             float newRed = 0, newGreen = 0, newBlue = 0;
 
@@ -217,9 +361,10 @@ void sharpen(int height, int width, RGBTRIPLE image[height][width])
                     // Check if the neighbor is within image bounds
                     if (new_i >= 0 && new_i < height && new_j >= 0 && new_j < width)
                     {
-                        newRed += temp[new_i][new_j].rgbtRed * kernel[di + 1][dj + 1];
-                        newGreen += temp[new_i][new_j].rgbtGreen * kernel[di + 1][dj + 1];
-                        newBlue += temp[new_i][new_j].rgbtBlue * kernel[di + 1][dj + 1];
+                        RGBTRIPLE *p = &temp[new_i - window.top][new_j - window.left];
+                        newRed += p->rgbtRed * kernel[di + 1][dj + 1];
+                        newGreen += p->rgbtGreen * kernel[di + 1][dj + 1];
+                        newBlue += p->rgbtBlue * kernel[di + 1][dj + 1];
                     }
                 }
             }
@@ -236,14 +381,23 @@ void sharpen(int height, int width, RGBTRIPLE image[height][width])
 // Emboss image
 void emboss(int height, int width, RGBTRIPLE image[height][width])
 {
-    // Create a temporary copy of the image
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+    emboss_roi(height, width, image, (ROI){0, 0, height, width});
+}
+
+// Emboss a region, reading neighbours from outside it
+void emboss_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi)
+{
+    if (!clip_roi(height, width, &roi))
     {
-        for (int j = 0; j < width; j++)
-        {
-            temp[i][j] = image[i][j];
-        }
+        return;
+    }
+
+    // Copy the region and its border, which the loop below overwrites
+    ROI window = kernel_window(height, width, roi);
+    RGBTRIPLE (*temp)[window.width] = copy_window(height, width, image, window);
+    if (!temp)
+    {
+        return;
     }
 
     // Emboss kernel
@@ -253,9 +407,9 @@ void emboss(int height, int width, RGBTRIPLE image[height][width])
         { 0,  1, 2}
     };
 
-    for (int i = 0; i < height; i++)
+    for (int i = roi.top; i < roi.top + roi.height; i++)
     {
-        for (int j = 0; j < width; j++)
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
             float newRed = 0, newGreen = 0, newBlue = 0;
 
@@ -268,9 +422,10 @@ void emboss(int height, int width, RGBTRIPLE image[height][width])
 
                     if (new_i >= 0 && new_i < height && new_j >= 0 && new_j < width)
                     {
-                        newRed += temp[new_i][new_j].rgbtRed * kernel[di + 1][dj + 1];
-                        newGreen += temp[new_i][new_j].rgbtGreen * kernel[di + 1][dj + 1];
-                        newBlue += temp[new_i][new_j].rgbtBlue * kernel[di + 1][dj + 1];
+                        RGBTRIPLE *p = &temp[new_i - window.top][new_j - window.left];
+                        newRed += p->rgbtRed * kernel[di + 1][dj + 1];
+                        newGreen += p->rgbtGreen * kernel[di + 1][dj + 1];
+                        newBlue += p->rgbtBlue * kernel[di + 1][dj + 1];
                     }
                 }
             }
@@ -282,4 +437,4 @@ void emboss(int height, int width, RGBTRIPLE image[height][width])
         }
     }
     return;
-}
\ No newline at end of file
+}
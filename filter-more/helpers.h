@@ -1,25 +1,57 @@
+#include <stddef.h>
+
 #include "bmp.h"
 
+// Rectangular region of interest: rows top..top+height-1, columns left..left+width-1
+// Regions are clipped to the image; kernel filters still read the pixels around them
+typedef struct
+{
+    int top;
+    int left;
+    int height;
+    int width;
+} ROI;
+
+// Clip roi to the image, returns 0 if nothing is left of it
+int clip_roi(int height, int width, ROI *roi);
+
+// The pixels a 3x3 kernel filter reads for roi: roi plus a 1-pixel border, clipped to the image
+// Callers that filter a copy of a region copy this window and pass roi relative to it
+ROI kernel_window(int height, int width, ROI roi);
+
+// Blur, edges, sharpen and emboss copy the pixels they read into a scratch buffer
+// that each thread keeps and reuses; if it cannot grow, they leave the image alone
+// Reserve room for pixels pixels up front to find out, returns 0 on success, 1 if out of memory
+int filter_scratch_reserve(size_t pixels);
+
 // Convert image to grayscale
 void grayscale(int height, int width, RGBTRIPLE image[height][width]);
+void grayscale_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // Reflect image horizontally
 void reflect(int height, int width, RGBTRIPLE image[height][width]);
+void reflect_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // Detect edges
 void edges(int height, int width, RGBTRIPLE image[height][width]);
+void edges_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // Blur image
 void blur(int height, int width, RGBTRIPLE image[height][width]);
+void blur_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // Negative image
 void negative(int height, int width,RGBTRIPLE image[height][width]);
+void negative_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // Sepia filter
 void sepia(int height, int width,RGBTRIPLE image[height][width]);
+void sepia_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // sharpen filter
 void sharpen(int height, int width, RGBTRIPLE image[height][width]);
+void sharpen_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
 
 // emboss filter
-void emboss(int height, int width, RGBTRIPLE image[height][width]);
\ No newline at end of file
+void emboss(int height, int width, RGBTRIPLE image[height][width]);
+void emboss_roi(int height, int width, RGBTRIPLE image[height][width], ROI roi);
\ No newline at end of file
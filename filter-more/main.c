@@ -1,38 +1,121 @@
 #include <gtk/gtk.h>
 #include "helpers.h"
+#include "bmpio.h"
+#include "pngio.h"
+#include "cache.h"
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 
+// Memory budget for remembered filter results
+#define RESULT_CACHE_MAX_BYTES (256 << 20)
+
+// Memory budget for undo steps; the oldest are forgotten first
+#define UNDO_MAX_BYTES (256 << 20)
+
+// Rows a BMP save converts and writes between progress updates, in bytes
+#define BMP_BAND_BYTES (1 << 20)
+
+// Formats offered in the save format drop-down, in order
+enum
+{
+    SAVE_PNG,
+    SAVE_BMP
+};
+
+// Pixels for one displayed texture, kept apart from the pixbuf filters change
+typedef struct
+{
+    GBytes *bytes;
+    GdkTexture *texture;  // Weak: NULL once nothing holds the texture
+} DisplayBuffer;
+
+// Pixels a filter overwrote, so Undo can put them back
+typedef struct
+{
+    ROI roi;
+    uint64_t state;   // image_state before the filter
+    guchar *pixels;   // roi.height rows of roi.width pixels, as laid out in the pixbuf
+    size_t size;
+} UndoStep;
+
 // A struct to hold pointers to widgets we need to access in different functions
 typedef struct
 {
     GtkWindow *window;
-    GtkImage *image_display;
+    GtkPicture *image_display;
+    GtkWidget *selection_area;
     GtkWidget *filter_box;
     GtkWidget *save_button;
+    GtkWidget *format_dropdown;
+    GtkWidget *level_spin;
+    int save_format;  // Format chosen when Save was clicked
+    GtkWidget *progress_bar;
+    GtkWidget *cache_label;
+    GtkWidget *undo_button;
     GdkPixbuf *current_pixbuf;
+    GdkTexture *texture;
+    MemoryCache *result_cache;
+
+    // Identifies the current pixels: a hash of the image as loaded, chained
+    // through every filter and region applied since, and rewound by Undo
+    uint64_t image_state;
+    GQueue *undo;  // Newest step first
+    size_t undo_bytes;
+
+    // Double-buffered pixels behind the displayed texture
+    DisplayBuffer display[2];
+    int display_front;
+    ROI display_behind;  // Last rectangle copied into the front but not the back
+    gboolean display_behind_valid;
+
+    // Rubber-band selection, in image pixels once the drag ends
+    ROI selection;
+    gboolean has_selection;
+    gboolean dragging;
+    double drag_x, drag_y, drag_dx, drag_dy;
 } AppWidgets;
 
-// Function to convert GdkPixbuf to a 2D RGBTRIPLE array
-RGBTRIPLE (*pixbuf_to_rgbtriple(GdkPixbuf *pixbuf, int *height, int *width))[0]
+// Everything a background save needs, owned by its GTask
+// The window may be closed mid-save, so widgets are only held weakly
+typedef struct
+{
+    GApplication *app;
+    GWeakRef window;
+    GWeakRef progress_bar;
+    GWeakRef save_button;
+    GdkPixbuf *pixbuf;
+    char *path;
+    int format;
+    int level;
+} SaveJob;
+
+// A progress value posted from the save thread to the main loop
+typedef struct
+{
+    GTask *task;
+    double fraction;
+} SaveProgress;
+
+// Function to copy a region of a GdkPixbuf into a new 2D RGBTRIPLE array
+RGBTRIPLE (*pixbuf_region_to_rgbtriple(GdkPixbuf *pixbuf, ROI region))[0]
 {
-    *width = gdk_pixbuf_get_width(pixbuf);
-    *height = gdk_pixbuf_get_height(pixbuf);
     int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
     int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
     guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
 
-    RGBTRIPLE (*image)[*width] = malloc(sizeof(RGBTRIPLE[*height][*width]));
+    RGBTRIPLE (*image)[region.width] = malloc(sizeof(RGBTRIPLE[region.height][region.width]));
     if (!image)
     {
         return NULL;
     }
 
-    for (int i = 0; i < *height; i++)
+    for (int i = 0; i < region.height; i++)
     {
-        for (int j = 0; j < *width; j++)
+        for (int j = 0; j < region.width; j++)
         {
-            guchar *p = pixels + i * rowstride + j * n_channels;
+            guchar *p = pixels + (region.top + i) * rowstride + (region.left + j) * n_channels;
             image[i][j].rgbtRed = p[0];
             image[i][j].rgbtGreen = p[1];
             image[i][j].rgbtBlue = p[2];
@@ -41,29 +124,209 @@ RGBTRIPLE (*pixbuf_to_rgbtriple(GdkPixbuf *pixbuf, int *height, int *width))[0]
     return image;
 }
 
-// Function to convert a 2D RGBTRIPLE array back to a GdkPixbuf
-GdkPixbuf *rgbtriple_to_pixbuf(int height, int width, RGBTRIPLE image[height][width])
+// Function to convert GdkPixbuf to a 2D RGBTRIPLE array
+RGBTRIPLE (*pixbuf_to_rgbtriple(GdkPixbuf *pixbuf, int *height, int *width))[0]
 {
-    GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
-    if (!pixbuf)
-    {
-        return NULL;
-    }
+    *width = gdk_pixbuf_get_width(pixbuf);
+    *height = gdk_pixbuf_get_height(pixbuf);
+    return pixbuf_region_to_rgbtriple(pixbuf, (ROI){0, 0, *height, *width});
+}
 
+// Function to copy the roi part of a 2D RGBTRIPLE array back into a GdkPixbuf
+// The array covers height x width pixels starting at (top, left) in the pixbuf
+void rgbtriple_to_pixbuf_region(GdkPixbuf *pixbuf, int top, int left, int height, int width,
+                                RGBTRIPLE image[height][width], ROI roi)
+{
+    int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
     int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
     guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
 
-    for (int i = 0; i < height; i++)
+    for (int i = roi.top; i < roi.top + roi.height; i++)
     {
-        for (int j = 0; j < width; j++)
+        for (int j = roi.left; j < roi.left + roi.width; j++)
         {
-            guchar *p = pixels + i * rowstride + j * 3;
+            guchar *p = pixels + (top + i) * rowstride + (left + j) * n_channels;
             p[0] = image[i][j].rgbtRed;
             p[1] = image[i][j].rgbtGreen;
             p[2] = image[i][j].rgbtBlue;
         }
     }
-    return pixbuf;
+}
+
+// Copy one rectangle of the pixbuf into a display buffer laid out the same way
+static void copy_display_rect(GdkPixbuf *pixbuf, guchar *dst, const ROI *rect)
+{
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    int n_channels = gdk_pixbuf_get_n_channels(pixbuf);
+    const guchar *src = gdk_pixbuf_read_pixels(pixbuf);
+
+    for (int i = rect->top; i < rect->top + rect->height; i++)
+    {
+        size_t offset = (size_t)i * rowstride + (size_t)rect->left * n_channels;
+        memcpy(dst + offset, src + offset, (size_t)rect->width * n_channels);
+    }
+}
+
+// Show the current pixbuf; with a dirty rectangle only that part is re-uploaded
+// Textures never share memory with the pixbuf, which filters change in place:
+// each one is built on the back of two buffers, brought up to date by copying
+// only the rectangles changed since it was last shown
+static void update_display(AppWidgets *widgets, const ROI *dirty)
+{
+    GdkPixbuf *pixbuf = widgets->current_pixbuf;
+    gsize size = gdk_pixbuf_get_byte_length(pixbuf);
+    DisplayBuffer *back = &widgets->display[!widgets->display_front];
+
+    // A buffer whose texture is still held elsewhere must not change under it
+    gboolean fresh = !back->bytes || back->texture || g_bytes_get_size(back->bytes) != size;
+    if (fresh)
+    {
+        if (back->texture)
+        {
+            g_object_remove_weak_pointer(G_OBJECT(back->texture), (gpointer *)&back->texture);
+            back->texture = NULL;
+        }
+        if (back->bytes)
+        {
+            g_bytes_unref(back->bytes);
+        }
+        back->bytes = g_bytes_new_take(g_malloc(size), size);
+    }
+
+    // The back buffer missed the front's last update as well as this one
+    guchar *pixels = (guchar *)g_bytes_get_data(back->bytes, NULL);
+    if (!fresh && dirty && widgets->display_behind_valid)
+    {
+        copy_display_rect(pixbuf, pixels, &widgets->display_behind);
+        copy_display_rect(pixbuf, pixels, dirty);
+    }
+    else
+    {
+        memcpy(pixels, gdk_pixbuf_read_pixels(pixbuf), size);
+    }
+
+    int width = gdk_pixbuf_get_width(pixbuf);
+    int height = gdk_pixbuf_get_height(pixbuf);
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    GdkMemoryFormat format = gdk_pixbuf_get_has_alpha(pixbuf) ? GDK_MEMORY_R8G8B8A8 : GDK_MEMORY_R8G8B8;
+    GdkTexture *texture;
+
+#if GTK_CHECK_VERSION(4, 16, 0)
+    GdkMemoryTextureBuilder *builder = gdk_memory_texture_builder_new();
+    gdk_memory_texture_builder_set_bytes(builder, back->bytes);
+    gdk_memory_texture_builder_set_stride(builder, rowstride);
+    gdk_memory_texture_builder_set_width(builder, width);
+    gdk_memory_texture_builder_set_height(builder, height);
+    gdk_memory_texture_builder_set_format(builder, format);
+
+    // Describe the new texture as an update of the old, untouched one, so the
+    // renderer only re-uploads and redraws the rectangle the filter touched
+    if (dirty && widgets->texture)
+    {
+        cairo_rectangle_int_t rect = {dirty->left, dirty->top, dirty->width, dirty->height};
+        cairo_region_t *region = cairo_region_create_rectangle(&rect);
+        gdk_memory_texture_builder_set_update_texture(builder, widgets->texture);
+        gdk_memory_texture_builder_set_update_region(builder, region);
+        cairo_region_destroy(region);
+    }
+
+    texture = gdk_memory_texture_builder_build(builder);
+    g_object_unref(builder);
+#else
+    // Older GTK has no partial texture updates; upload the whole image
+    texture = gdk_memory_texture_new(width, height, format, back->bytes, rowstride);
+#endif
+
+    back->texture = texture;
+    g_object_add_weak_pointer(G_OBJECT(texture), (gpointer *)&back->texture);
+    widgets->display_front = !widgets->display_front;
+    widgets->display_behind_valid = dirty != NULL;
+    if (dirty)
+    {
+        widgets->display_behind = *dirty;
+    }
+
+    if (widgets->texture)
+    {
+        g_object_unref(widgets->texture);
+    }
+    widgets->texture = texture;
+    gtk_picture_set_paintable(widgets->image_display, GDK_PAINTABLE(texture));
+}
+
+// Free an undo step
+static void undo_step_free(gpointer data)
+{
+    UndoStep *step = data;
+    g_free(step->pixels);
+    g_free(step);
+}
+
+// Forget every undo step
+static void clear_undo(AppWidgets *widgets)
+{
+    g_queue_clear_full(widgets->undo, undo_step_free);
+    widgets->undo_bytes = 0;
+    gtk_widget_set_sensitive(widgets->undo_button, FALSE);
+}
+
+// Remember the pixels in roi before a filter overwrites them
+static void push_undo(AppWidgets *widgets, ROI roi)
+{
+    GdkPixbuf *pixbuf = widgets->current_pixbuf;
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    size_t row_bytes = (size_t)roi.width * gdk_pixbuf_get_n_channels(pixbuf);
+    const guchar *pixels = gdk_pixbuf_read_pixels(pixbuf) + (size_t)roi.top * rowstride +
+                           (size_t)roi.left * gdk_pixbuf_get_n_channels(pixbuf);
+
+    UndoStep *step = g_new(UndoStep, 1);
+    step->roi = roi;
+    step->state = widgets->image_state;
+    step->size = row_bytes * roi.height;
+    step->pixels = g_malloc(step->size);
+    for (int i = 0; i < roi.height; i++)
+    {
+        memcpy(step->pixels + i * row_bytes, pixels + (size_t)i * rowstride, row_bytes);
+    }
+    g_queue_push_head(widgets->undo, step);
+    widgets->undo_bytes += step->size;
+
+    // Stay within budget, but always keep the step just taken
+    while (widgets->undo_bytes > UNDO_MAX_BYTES && g_queue_get_length(widgets->undo) > 1)
+    {
+        UndoStep *oldest = g_queue_pop_tail(widgets->undo);
+        widgets->undo_bytes -= oldest->size;
+        undo_step_free(oldest);
+    }
+    gtk_widget_set_sensitive(widgets->undo_button, TRUE);
+}
+
+// Callback for the "Undo" button: put back the pixels the last filter changed
+static void on_undo_clicked(GtkButton *button, gpointer user_data)
+{
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    UndoStep *step = g_queue_pop_head(widgets->undo);
+    if (!step)
+    {
+        return;
+    }
+
+    GdkPixbuf *pixbuf = widgets->current_pixbuf;
+    int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+    size_t row_bytes = (size_t)step->roi.width * gdk_pixbuf_get_n_channels(pixbuf);
+    guchar *pixels = gdk_pixbuf_get_pixels(pixbuf) + (size_t)step->roi.top * rowstride +
+                     (size_t)step->roi.left * gdk_pixbuf_get_n_channels(pixbuf);
+    for (int i = 0; i < step->roi.height; i++)
+    {
+        memcpy(pixels + (size_t)i * rowstride, step->pixels + i * row_bytes, row_bytes);
+    }
+
+    // Back to the earlier pixels, so filters applied now hit the cache again
+    widgets->image_state = step->state;
+    widgets->undo_bytes -= step->size;
+    update_display(widgets, &step->roi);
+    undo_step_free(step);
+    gtk_widget_set_sensitive(widgets->undo_button, !g_queue_is_empty(widgets->undo));
 }
 
 // Generic function to apply a filter
@@ -77,32 +340,175 @@ static void apply_filter(GtkButton *button, gpointer user_data)
         return;
     }
 
-    int height, width;
-    RGBTRIPLE (*image_data)[width] = pixbuf_to_rgbtriple(widgets->current_pixbuf, &height, &width);
-    if (!image_data)
+    // Work on the selection, or the whole image when nothing is selected
+    GdkPixbuf *pixbuf = widgets->current_pixbuf;
+    int height = gdk_pixbuf_get_height(pixbuf);
+    int width = gdk_pixbuf_get_width(pixbuf);
+    ROI roi = widgets->has_selection ? widgets->selection : (ROI){0, 0, height, width};
+    if (!clip_roi(height, width, &roi))
     {
-        g_print("Failed to convert pixbuf to RGBTRIPLE array.\n");
         return;
     }
 
-    if (g_strcmp0(filter_name, "Grayscale") == 0)      grayscale(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Reflect") == 0)   reflect(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Blur") == 0)      blur(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Edges") == 0)     edges(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Sepia") == 0)     sepia(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Negative") == 0)  negative(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Sharpen") == 0)   sharpen(height, width, image_data);
-    else if (g_strcmp0(filter_name, "Emboss") == 0)    emboss(height, width, image_data);
+    // Copy out the region plus the 1-pixel border the kernel filters read
+    ROI window = kernel_window(height, width, roi);
+    ROI local = {roi.top - window.top, roi.left - window.left, roi.height, roi.width};
+
+    // The result is known if this filter already ran on this region of the
+    // same pixels, e.g. after undoing it or another filter; no pixels need hashing
+    size_t size = (size_t)window.height * window.width * sizeof(RGBTRIPLE);
+    char *params = g_strdup_printf("%d,%d,%d,%d", roi.top, roi.left, roi.height, roi.width);
+    uint64_t key = hash_filter_request(&widgets->image_state, sizeof(widgets->image_state), height, width,
+                                       filter_name, params);
+    g_free(params);
+    const void *cached = memory_cache_get(widgets->result_cache, key, size);
+
+    RGBTRIPLE (*image_data)[window.width] = NULL;
+    if (!cached)
+    {
+        image_data = pixbuf_region_to_rgbtriple(pixbuf, window);
+        if (!image_data)
+        {
+            g_print("Failed to convert pixbuf to RGBTRIPLE array.\n");
+            return;
+        }
+
+        // The kernel filters need scratch room for a copy of the window
+        if (filter_scratch_reserve((size_t)window.height * window.width) != 0)
+        {
+            g_print("Not enough memory to filter image.\n");
+            free(image_data);
+            return;
+        }
 
-    GdkPixbuf *new_pixbuf = rgbtriple_to_pixbuf(height, width, image_data);
+        int h = window.height, w = window.width;
+        if (g_strcmp0(filter_name, "Grayscale") == 0)      grayscale_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Reflect") == 0)   reflect_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Blur") == 0)      blur_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Edges") == 0)     edges_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Sepia") == 0)     sepia_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Negative") == 0)  negative_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Sharpen") == 0)   sharpen_roi(h, w, image_data, local);
+        else if (g_strcmp0(filter_name, "Emboss") == 0)    emboss_roi(h, w, image_data, local);
+
+        memory_cache_put(widgets->result_cache, key, image_data, size);
+    }
+
+    // Write back only the filtered rectangle and redraw only that
+    push_undo(widgets, roi);
+    widgets->image_state = key;
+    rgbtriple_to_pixbuf_region(pixbuf, window.top, window.left, window.height, window.width,
+                               cached ? (void *)cached : (void *)image_data, local);
     free(image_data);
+    update_display(widgets, &roi);
+
+    char *stats = g_strdup_printf("Cache: %lu hits, %lu misses",
+                                  widgets->result_cache->hits, widgets->result_cache->misses);
+    gtk_label_set_text(GTK_LABEL(widgets->cache_label), stats);
+    g_free(stats);
+}
 
-    if (new_pixbuf)
+// Where the picture draws the image: scale and top-left corner, letterboxed
+static gboolean image_layout(AppWidgets *widgets, double *scale, double *x0, double *y0)
+{
+    if (!widgets->current_pixbuf)
     {
-        g_object_unref(widgets->current_pixbuf);
-        widgets->current_pixbuf = new_pixbuf;
-        gtk_image_set_from_paintable(widgets->image_display, GDK_PAINTABLE(widgets->current_pixbuf));
+        return FALSE;
     }
+    double view_width = gtk_widget_get_width(GTK_WIDGET(widgets->image_display));
+    double view_height = gtk_widget_get_height(GTK_WIDGET(widgets->image_display));
+    double image_width = gdk_pixbuf_get_width(widgets->current_pixbuf);
+    double image_height = gdk_pixbuf_get_height(widgets->current_pixbuf);
+
+    *scale = MIN(view_width / image_width, view_height / image_height);
+    *x0 = (view_width - image_width * *scale) / 2;
+    *y0 = (view_height - image_height * *scale) / 2;
+    return *scale > 0;
+}
+
+// Draw the rubber band while dragging, and the selection afterwards
+static void draw_selection(GtkDrawingArea *area, cairo_t *cr, int width, int height, gpointer user_data)
+{
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    double x, y, w, h;
+    double scale, x0, y0;
+
+    if (widgets->dragging)
+    {
+        x = MIN(widgets->drag_x, widgets->drag_x + widgets->drag_dx);
+        y = MIN(widgets->drag_y, widgets->drag_y + widgets->drag_dy);
+        w = fabs(widgets->drag_dx);
+        h = fabs(widgets->drag_dy);
+    }
+    else if (widgets->has_selection && image_layout(widgets, &scale, &x0, &y0))
+    {
+        x = x0 + widgets->selection.left * scale;
+        y = y0 + widgets->selection.top * scale;
+        w = widgets->selection.width * scale;
+        h = widgets->selection.height * scale;
+    }
+    else
+    {
+        return;
+    }
+
+    cairo_rectangle(cr, x + 0.5, y + 0.5, w, h);
+    cairo_set_source_rgba(cr, 0.2, 0.5, 1.0, 0.15);
+    cairo_fill_preserve(cr);
+    cairo_set_source_rgb(cr, 0.2, 0.5, 1.0);
+    cairo_set_line_width(cr, 1.0);
+    cairo_stroke(cr);
+}
+
+// Start a rubber-band selection
+static void on_drag_begin(GtkGestureDrag *gesture, double x, double y, gpointer user_data)
+{
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    widgets->dragging = TRUE;
+    widgets->drag_x = x;
+    widgets->drag_y = y;
+    widgets->drag_dx = 0;
+    widgets->drag_dy = 0;
+    gtk_widget_queue_draw(widgets->selection_area);
+}
+
+// Follow the pointer
+static void on_drag_update(GtkGestureDrag *gesture, double dx, double dy, gpointer user_data)
+{
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    widgets->drag_dx = dx;
+    widgets->drag_dy = dy;
+    gtk_widget_queue_draw(widgets->selection_area);
+}
+
+// Turn the rubber band into a selection in image pixels; a click clears it
+static void on_drag_end(GtkGestureDrag *gesture, double dx, double dy, gpointer user_data)
+{
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    double scale, x0, y0;
+
+    widgets->dragging = FALSE;
+    widgets->has_selection = FALSE;
+
+    if (image_layout(widgets, &scale, &x0, &y0))
+    {
+        int height = gdk_pixbuf_get_height(widgets->current_pixbuf);
+        int width = gdk_pixbuf_get_width(widgets->current_pixbuf);
+        double ax = (widgets->drag_x - x0) / scale, ay = (widgets->drag_y - y0) / scale;
+        double bx = (widgets->drag_x + dx - x0) / scale, by = (widgets->drag_y + dy - y0) / scale;
+
+        int left = CLAMP((int)floor(MIN(ax, bx)), 0, width);
+        int top = CLAMP((int)floor(MIN(ay, by)), 0, height);
+        int right = CLAMP((int)ceil(MAX(ax, bx)), 0, width);
+        int bottom = CLAMP((int)ceil(MAX(ay, by)), 0, height);
+
+        if (right - left >= 2 && bottom - top >= 2)
+        {
+            widgets->selection = (ROI){top, left, bottom - top, right - left};
+            widgets->has_selection = TRUE;
+        }
+    }
+    gtk_widget_queue_draw(widgets->selection_area);
 }
 
 // Modern GTK4 callback for the "Open" dialog
@@ -123,9 +529,17 @@ static void open_cb(GObject *source_object, GAsyncResult *res, gpointer user_dat
         widgets->current_pixbuf = gdk_pixbuf_new_from_file(path, NULL);
         g_free(path);
 
+        widgets->has_selection = FALSE;
+        gtk_widget_queue_draw(widgets->selection_area);
+        clear_undo(widgets);
+
         if (widgets->current_pixbuf)
         {
-            gtk_image_set_from_paintable(widgets->image_display, GDK_PAINTABLE(widgets->current_pixbuf));
+            // Filter results are keyed on the pixels as loaded plus what was applied since
+            GdkPixbuf *pixbuf = widgets->current_pixbuf;
+            widgets->image_state = hash_filter_request(gdk_pixbuf_read_pixels(pixbuf), gdk_pixbuf_get_byte_length(pixbuf),
+                                                       gdk_pixbuf_get_height(pixbuf), gdk_pixbuf_get_width(pixbuf), "", "");
+            update_display(widgets, NULL);
             gtk_widget_set_sensitive(widgets->filter_box, TRUE);
             gtk_widget_set_sensitive(widgets->save_button, TRUE);
         }
@@ -142,6 +556,156 @@ static void on_open_clicked(GtkButton *button, gpointer user_data)
     g_object_unref(dialog);
 }
 
+// Free a SaveJob once its task is done
+static void save_job_free(gpointer data)
+{
+    SaveJob *job = data;
+    g_weak_ref_clear(&job->window);
+    g_weak_ref_clear(&job->progress_bar);
+    g_weak_ref_clear(&job->save_button);
+    g_object_unref(job->app);
+    g_object_unref(job->pixbuf);
+    g_free(job->path);
+    g_free(job);
+}
+
+// Update the progress bar on the main loop
+static gboolean save_progress_idle(gpointer data)
+{
+    SaveProgress *update = data;
+    SaveJob *job = g_task_get_task_data(update->task);
+    GtkWidget *progress_bar = g_weak_ref_get(&job->progress_bar);
+    if (progress_bar)
+    {
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), update->fraction);
+        g_object_unref(progress_bar);
+    }
+    g_object_unref(update->task);
+    g_free(update);
+    return G_SOURCE_REMOVE;
+}
+
+// Called by the encoder threads; hand the value over to the main loop
+// Each update holds the task, so the job outlives every pending update
+static void save_progress(double fraction, void *data)
+{
+    SaveProgress *update = g_new(SaveProgress, 1);
+    update->task = g_object_ref(data);
+    update->fraction = fraction;
+    g_idle_add(save_progress_idle, update);
+}
+
+// Runs on a worker thread: encode and write the image
+static void save_thread(GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+    SaveJob *job = task_data;
+
+    FILE *outptr = fopen(job->path, "wb");
+    if (outptr == NULL)
+    {
+        g_task_return_new_error(task, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Could not create %s", job->path);
+        return;
+    }
+
+    int failed = 0;
+    if (job->format == SAVE_BMP)
+    {
+        // Reuse the command-line filter's BMP writer, converting and writing
+        // a band of rows at a time so progress follows the write
+        int height = gdk_pixbuf_get_height(job->pixbuf);
+        int width = gdk_pixbuf_get_width(job->pixbuf);
+        BITMAPFILEHEADER bf;
+        BITMAPINFOHEADER bi;
+        init_bmp_headers(height, width, &bf, &bi);
+        write_bmp_headers(outptr, &bf, &bi);
+
+        int band = MAX(1, BMP_BAND_BYTES / (width * (int)sizeof(RGBTRIPLE)));
+        for (int top = 0; top < height; top += band)
+        {
+            int rows = MIN(band, height - top);
+            RGBTRIPLE (*image)[width] = pixbuf_region_to_rgbtriple(job->pixbuf, (ROI){top, 0, rows, width});
+            if (!image)
+            {
+                failed = 1;
+                break;
+            }
+            write_bmp_rows(outptr, rows, width, image);
+            free(image);
+            save_progress((double)(top + rows) / height, task);
+        }
+    }
+    else
+    {
+        failed = write_png(outptr, gdk_pixbuf_get_height(job->pixbuf), gdk_pixbuf_get_width(job->pixbuf),
+                           gdk_pixbuf_get_n_channels(job->pixbuf), gdk_pixbuf_get_rowstride(job->pixbuf),
+                           gdk_pixbuf_read_pixels(job->pixbuf), job->level, save_progress, task);
+    }
+
+    if (ferror(outptr))
+    {
+        failed = 1;
+    }
+    if (fclose(outptr) != 0)
+    {
+        failed = 1;
+    }
+
+    if (failed)
+    {
+        g_task_return_new_error(task, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Could not write %s", job->path);
+        return;
+    }
+    g_task_return_boolean(task, TRUE);
+}
+
+// The user has dismissed a save error; let the application go
+static void save_alert_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    GApplication *app = user_data;
+    gtk_alert_dialog_choose_finish(GTK_ALERT_DIALOG(source_object), res, NULL);
+    g_application_release(app);
+    g_object_unref(app);
+}
+
+// Back on the main loop once the save thread has finished
+static void save_done(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+    SaveJob *job = g_task_get_task_data(G_TASK(res));
+    GError *error = NULL;
+
+    if (!g_task_propagate_boolean(G_TASK(res), &error))
+    {
+        // Show the error over the window, or on its own if the window was closed,
+        // keeping the application alive until the user has seen it
+        GtkWindow *window = g_weak_ref_get(&job->window);
+        GtkAlertDialog *alert = gtk_alert_dialog_new("Could not save image");
+        gtk_alert_dialog_set_detail(alert, error->message);
+        g_application_hold(job->app);
+        gtk_alert_dialog_choose(alert, window, NULL, save_alert_done, g_object_ref(job->app));
+        g_object_unref(alert);
+        if (window)
+        {
+            g_object_unref(window);
+        }
+        g_error_free(error);
+    }
+
+    // Only touch the widgets if the window is still open
+    GtkWidget *progress_bar = g_weak_ref_get(&job->progress_bar);
+    if (progress_bar)
+    {
+        gtk_widget_set_visible(progress_bar, FALSE);
+        g_object_unref(progress_bar);
+    }
+    GtkWidget *save_button = g_weak_ref_get(&job->save_button);
+    if (save_button)
+    {
+        gtk_widget_set_sensitive(save_button, TRUE);
+        g_object_unref(save_button);
+    }
+    g_application_release(job->app);
+}
+
 // Modern GTK4 callback for the "Save" dialog
 static void save_cb(GObject *source_object, GAsyncResult *res, gpointer user_data)
 {
@@ -151,10 +715,53 @@ static void save_cb(GObject *source_object, GAsyncResult *res, gpointer user_dat
 
     if (file)
     {
-        char *path = g_file_get_path(file);
-        gdk_pixbuf_save(widgets->current_pixbuf, path, "png", NULL, NULL);
-        g_free(path);
+        // Snapshot the current image; filters change the pixbuf in place
+        GdkPixbuf *snapshot = gdk_pixbuf_copy(widgets->current_pixbuf);
+        if (!snapshot)
+        {
+            GtkAlertDialog *alert = gtk_alert_dialog_new("Not enough memory to save image");
+            gtk_alert_dialog_show(alert, widgets->window);
+            g_object_unref(alert);
+            g_object_unref(file);
+            return;
+        }
+        SaveJob *job = g_new(SaveJob, 1);
+        job->app = G_APPLICATION(g_object_ref(gtk_window_get_application(widgets->window)));
+        g_weak_ref_init(&job->window, widgets->window);
+        g_weak_ref_init(&job->progress_bar, widgets->progress_bar);
+        g_weak_ref_init(&job->save_button, widgets->save_button);
+        job->pixbuf = snapshot;
+        job->path = g_file_get_path(file);
+        // The chosen name's extension decides the format; otherwise use the one
+        // picked when Save was clicked, which also chose the suggested name
+        char *lower = g_ascii_strdown(job->path, -1);
+        if (g_str_has_suffix(lower, ".bmp"))
+        {
+            job->format = SAVE_BMP;
+        }
+        else if (g_str_has_suffix(lower, ".png"))
+        {
+            job->format = SAVE_PNG;
+        }
+        else
+        {
+            job->format = widgets->save_format;
+        }
+        g_free(lower);
+        job->level = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widgets->level_spin));
         g_object_unref(file);
+
+        gtk_widget_set_sensitive(widgets->save_button, FALSE);
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(widgets->progress_bar), 0.0);
+        gtk_widget_set_visible(widgets->progress_bar, TRUE);
+
+        // Keep the application alive until the file is written
+        g_application_hold(job->app);
+
+        GTask *task = g_task_new(NULL, NULL, save_done, NULL);
+        g_task_set_task_data(task, job, save_job_free);
+        g_task_run_in_thread(task, save_thread);
+        g_object_unref(task);
     }
 }
 
@@ -163,11 +770,27 @@ static void on_save_clicked(GtkButton *button, gpointer user_data)
 {
     AppWidgets *widgets = (AppWidgets *)user_data;
     GtkFileDialog *dialog = gtk_file_dialog_new();
-    gtk_file_dialog_set_initial_name(dialog, "filtered-image.png");
+    widgets->save_format = gtk_drop_down_get_selected(GTK_DROP_DOWN(widgets->format_dropdown));
+    if (widgets->save_format == SAVE_BMP)
+    {
+        gtk_file_dialog_set_initial_name(dialog, "filtered-image.bmp");
+    }
+    else
+    {
+        gtk_file_dialog_set_initial_name(dialog, "filtered-image.png");
+    }
     gtk_file_dialog_save(dialog, widgets->window, NULL, save_cb, user_data);
     g_object_unref(dialog);
 }
 
+// Compression only applies to PNG
+static void on_format_changed(GObject *dropdown, GParamSpec *pspec, gpointer user_data)
+{
+    AppWidgets *widgets = (AppWidgets *)user_data;
+    guint format = gtk_drop_down_get_selected(GTK_DROP_DOWN(dropdown));
+    gtk_widget_set_sensitive(widgets->level_spin, format == SAVE_PNG);
+}
+
 // This function is called when the application is activated
 static void activate(GtkApplication *app, gpointer user_data)
 {
@@ -184,17 +807,49 @@ static void activate(GtkApplication *app, gpointer user_data)
     g_signal_connect(open_button, "clicked", G_CALLBACK(on_open_clicked), widgets);
     gtk_header_bar_pack_start(GTK_HEADER_BAR(header), open_button);
 
+    widgets->undo_button = gtk_button_new_with_label("Undo");
+    g_signal_connect(widgets->undo_button, "clicked", G_CALLBACK(on_undo_clicked), widgets);
+    gtk_header_bar_pack_start(GTK_HEADER_BAR(header), widgets->undo_button);
+    gtk_widget_set_sensitive(widgets->undo_button, FALSE);
+
     widgets->save_button = gtk_button_new_with_label("Save");
     g_signal_connect(widgets->save_button, "clicked", G_CALLBACK(on_save_clicked), widgets);
     gtk_header_bar_pack_end(GTK_HEADER_BAR(header), widgets->save_button);
     gtk_widget_set_sensitive(widgets->save_button, FALSE);
 
+    // Save format and PNG compression level (0 = fastest, 9 = smallest)
+    const char *formats[] = {"PNG", "BMP", NULL};
+    widgets->format_dropdown = gtk_drop_down_new_from_strings(formats);
+    g_signal_connect(widgets->format_dropdown, "notify::selected", G_CALLBACK(on_format_changed), widgets);
+    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), widgets->format_dropdown);
+
+    widgets->level_spin = gtk_spin_button_new_with_range(0, 9, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(widgets->level_spin), 6);
+    gtk_widget_set_tooltip_text(widgets->level_spin, "PNG compression: 0 is fastest, 9 is smallest");
+    gtk_header_bar_pack_end(GTK_HEADER_BAR(header), widgets->level_spin);
+
     GtkWidget *main_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 5);
     gtk_window_set_child(widgets->window, main_box);
 
-    widgets->image_display = GTK_IMAGE(gtk_image_new());
-    gtk_widget_set_vexpand(GTK_WIDGET(widgets->image_display), TRUE);
-    gtk_box_append(GTK_BOX(main_box), GTK_WIDGET(widgets->image_display));
+    // The picture scales the image to fit; a drawing area on top shows the selection
+    GtkWidget *overlay = gtk_overlay_new();
+    gtk_widget_set_vexpand(overlay, TRUE);
+    gtk_box_append(GTK_BOX(main_box), overlay);
+
+    widgets->image_display = GTK_PICTURE(gtk_picture_new());
+    gtk_overlay_set_child(GTK_OVERLAY(overlay), GTK_WIDGET(widgets->image_display));
+
+    widgets->selection_area = gtk_drawing_area_new();
+    gtk_widget_set_can_target(widgets->selection_area, FALSE);
+    gtk_drawing_area_set_draw_func(GTK_DRAWING_AREA(widgets->selection_area), draw_selection, widgets, NULL);
+    gtk_overlay_add_overlay(GTK_OVERLAY(overlay), widgets->selection_area);
+
+    // Drag on the image to select the region filters apply to
+    GtkGesture *drag = gtk_gesture_drag_new();
+    g_signal_connect(drag, "drag-begin", G_CALLBACK(on_drag_begin), widgets);
+    g_signal_connect(drag, "drag-update", G_CALLBACK(on_drag_update), widgets);
+    g_signal_connect(drag, "drag-end", G_CALLBACK(on_drag_end), widgets);
+    gtk_widget_add_controller(overlay, GTK_EVENT_CONTROLLER(drag));
 
     widgets->filter_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     gtk_widget_set_halign(widgets->filter_box, GTK_ALIGN_CENTER);
@@ -209,6 +864,13 @@ static void activate(GtkApplication *app, gpointer user_data)
     }
     gtk_widget_set_sensitive(widgets->filter_box, FALSE);
 
+    widgets->cache_label = gtk_label_new("Cache: 0 hits, 0 misses");
+    gtk_box_append(GTK_BOX(main_box), widgets->cache_label);
+
+    widgets->progress_bar = gtk_progress_bar_new();
+    gtk_widget_set_visible(widgets->progress_bar, FALSE);
+    gtk_box_append(GTK_BOX(main_box), widgets->progress_bar);
+
     gtk_window_present(widgets->window);
 }
 
@@ -217,8 +879,15 @@ int main(int argc, char **argv)
     GtkApplication *app;
     int status;
 
-    AppWidgets *widgets = g_new(AppWidgets, 1);
-    widgets->current_pixbuf = NULL;
+    AppWidgets *widgets = g_new0(AppWidgets, 1);
+    widgets->result_cache = memory_cache_new(RESULT_CACHE_MAX_BYTES);
+    if (!widgets->result_cache)
+    {
+        g_print("Not enough memory to start.\n");
+        g_free(widgets);
+        return 1;
+    }
+    widgets->undo = g_queue_new();
 
     app = gtk_application_new("com.example.cimagefilters", G_APPLICATION_DEFAULT_FLAGS);
     g_signal_connect(app, "activate", G_CALLBACK(activate), widgets);
@@ -229,6 +898,24 @@ int main(int argc, char **argv)
     {
         g_object_unref(widgets->current_pixbuf);
     }
+    if (widgets->texture)
+    {
+        g_object_unref(widgets->texture);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (widgets->display[i].texture)
+        {
+            g_object_remove_weak_pointer(G_OBJECT(widgets->display[i].texture),
+                                         (gpointer *)&widgets->display[i].texture);
+        }
+        if (widgets->display[i].bytes)
+        {
+            g_bytes_unref(widgets->display[i].bytes);
+        }
+    }
+    g_queue_free_full(widgets->undo, undo_step_free);
+    memory_cache_free(widgets->result_cache);
     g_free(widgets);
 
     return status;
@@ -0,0 +1,426 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "pngio.h"
+
+// Amount of filtered scanline data each parallel deflate chunk aims for
+#define CHUNK_BYTES (256 * 1024)
+
+// Deflate's window: how far back a match can reach
+#define WINDOW_BYTES 32768
+
+// Share of the progress bar for deflating; writing the IDATs fills the rest
+#define ENCODE_SHARE 0.8
+
+// PNG scanline filter types used here
+enum
+{
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_PAETH = 4
+};
+
+// One independently deflated run of scanlines
+typedef struct
+{
+    unsigned char *data;  // Compressed bytes, with room for the zlib header and trailer
+    size_t size;          // Compressed bytes written after the header room
+    size_t raw_size;      // Filtered bytes fed to deflate
+    uLong adler;          // Adler-32 of the filtered bytes
+    int failed;
+} DeflateChunk;
+
+// Shared state for the encoder threads
+typedef struct
+{
+    const unsigned char *pixels;
+    int height, width, n_channels, rowstride;
+    int level, filter;
+    int rows_per_chunk, n_chunks;
+    DeflateChunk *chunks;
+    int next_chunk, done_chunks;
+    pthread_mutex_t lock;
+    ExportProgress progress;
+    void *data;
+} PngEncoder;
+
+// Write a 32-bit big-endian value
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Paeth predictor from the PNG specification
+static unsigned char paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+    {
+        return a;
+    }
+    return (pb <= pc) ? b : c;
+}
+
+// Filter one scanline into out, which starts with the filter type byte
+static void filter_row(PngEncoder *enc, int row, unsigned char *out)
+{
+    int bpp = enc->n_channels;
+    int len = enc->width * bpp;
+    const unsigned char *cur = enc->pixels + (size_t)row * enc->rowstride;
+    const unsigned char *up = row > 0 ? cur - enc->rowstride : NULL;
+
+    out[0] = enc->filter;
+    out++;
+
+    if (enc->filter == PNG_FILTER_NONE || !up)
+    {
+        // The first row has nothing above it, so Up and Paeth reduce to None and Sub
+        if (enc->filter == PNG_FILTER_PAETH && !up)
+        {
+            for (int k = 0; k < len; k++)
+            {
+                out[k] = cur[k] - (k >= bpp ? cur[k - bpp] : 0);
+            }
+        }
+        else
+        {
+            memcpy(out, cur, len);
+        }
+        return;
+    }
+
+    if (enc->filter == PNG_FILTER_UP)
+    {
+        for (int k = 0; k < len; k++)
+        {
+            out[k] = cur[k] - up[k];
+        }
+        return;
+    }
+
+    for (int k = 0; k < len; k++)
+    {
+        int a = k >= bpp ? cur[k - bpp] : 0;
+        int c = k >= bpp ? up[k - bpp] : 0;
+        out[k] = cur[k] - paeth(a, up[k], c);
+    }
+}
+
+// Filter and deflate one chunk of scanlines as a raw, byte-aligned deflate run
+static void encode_chunk(PngEncoder *enc, int index)
+{
+    DeflateChunk *chunk = &enc->chunks[index];
+    int first = index * enc->rows_per_chunk;
+    int last = first + enc->rows_per_chunk;
+    if (last > enc->height)
+    {
+        last = enc->height;
+    }
+    size_t row_size = 1 + (size_t)enc->width * enc->n_channels;
+    chunk->raw_size = (last - first) * row_size;
+
+    // Also filter the rows just before this chunk, so it can be primed with
+    // the window the previous chunk ends on; stored output needs no priming
+    int dict_rows = 0;
+    if (first > 0 && enc->level > 0)
+    {
+        dict_rows = (WINDOW_BYTES + row_size - 1) / row_size;
+        if (dict_rows > first)
+        {
+            dict_rows = first;
+        }
+    }
+    size_t dict_size = dict_rows * row_size;
+
+    unsigned char *buffer = malloc(dict_size + chunk->raw_size);
+    if (!buffer)
+    {
+        chunk->failed = 1;
+        return;
+    }
+    for (int i = first - dict_rows; i < last; i++)
+    {
+        filter_row(enc, i, buffer + (i - first + dict_rows) * row_size);
+    }
+    unsigned char *raw = buffer + dict_size;
+    chunk->adler = adler32(adler32(0L, Z_NULL, 0), raw, chunk->raw_size);
+
+    // Negative window bits: raw deflate, the zlib wrapper is written once for the whole stream
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    int strategy = enc->filter == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    if (deflateInit2(&strm, enc->level, Z_DEFLATED, -15, 8, strategy) != Z_OK)
+    {
+        free(buffer);
+        chunk->failed = 1;
+        return;
+    }
+
+    // Matches may reach back into the previous chunk's last 32 KiB, as they
+    // would in a single-threaded stream
+    if (dict_size > 0)
+    {
+        size_t window = dict_size < WINDOW_BYTES ? dict_size : WINDOW_BYTES;
+        if (deflateSetDictionary(&strm, raw - window, window) != Z_OK)
+        {
+            deflateEnd(&strm);
+            free(buffer);
+            chunk->failed = 1;
+            return;
+        }
+    }
+
+    // Room for the 2-byte zlib header before and the 4-byte Adler-32 after,
+    // plus the empty stored block a sync flush appends
+    size_t bound = deflateBound(&strm, chunk->raw_size) + 16;
+    chunk->data = malloc(2 + bound + 4);
+    if (!chunk->data)
+    {
+        deflateEnd(&strm);
+        free(buffer);
+        chunk->failed = 1;
+        return;
+    }
+
+    // Every chunk but the last ends on a byte boundary without closing the stream
+    int is_last = index == enc->n_chunks - 1;
+    strm.next_in = raw;
+    strm.avail_in = chunk->raw_size;
+    strm.next_out = chunk->data + 2;
+    strm.avail_out = bound;
+    int ret = deflate(&strm, is_last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((is_last && ret != Z_STREAM_END) || (!is_last && ret != Z_OK) || strm.avail_in != 0)
+    {
+        chunk->failed = 1;
+    }
+    chunk->size = bound - strm.avail_out;
+
+    deflateEnd(&strm);
+    free(buffer);
+}
+
+// Encoder thread: take chunks until none are left
+static void *encode_worker(void *arg)
+{
+    PngEncoder *enc = arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&enc->lock);
+        int index = enc->next_chunk++;
+        pthread_mutex_unlock(&enc->lock);
+        if (index >= enc->n_chunks)
+        {
+            break;
+        }
+
+        encode_chunk(enc, index);
+
+        pthread_mutex_lock(&enc->lock);
+        enc->done_chunks++;
+        if (enc->progress)
+        {
+            enc->progress(ENCODE_SHARE * enc->done_chunks / enc->n_chunks, enc->data);
+        }
+        pthread_mutex_unlock(&enc->lock);
+    }
+    return NULL;
+}
+
+// Write one PNG chunk: length, type, data and CRC
+static void write_png_chunk(FILE *outptr, const char *type, const unsigned char *data, size_t len)
+{
+    unsigned char buf[4];
+    put_be32(buf, len);
+    fwrite(buf, 1, 4, outptr);
+    fwrite(type, 1, 4, outptr);
+    if (len > 0)
+    {
+        fwrite(data, 1, len, outptr);
+    }
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *)type, 4);
+    if (len > 0)
+    {
+        crc = crc32(crc, data, len);
+    }
+    put_be32(buf, crc);
+    fwrite(buf, 1, 4, outptr);
+}
+
+// Write 8-bit RGB or RGBA pixels as a PNG
+int write_png(FILE *outptr, int height, int width, int n_channels, int rowstride,
+              const unsigned char *pixels, int level, ExportProgress progress, void *data)
+{
+    if (height <= 0 || width <= 0 || (n_channels != 3 && n_channels != 4))
+    {
+        return 1;
+    }
+    if (level < 0)
+    {
+        level = 0;
+    }
+    if (level > 9)
+    {
+        level = 9;
+    }
+
+    PngEncoder enc;
+    memset(&enc, 0, sizeof(enc));
+    enc.pixels = pixels;
+    enc.height = height;
+    enc.width = width;
+    enc.n_channels = n_channels;
+    enc.rowstride = rowstride;
+    enc.level = level;
+    enc.progress = progress;
+    enc.data = data;
+
+    // Cheaper filters for faster levels: stored data gains nothing from filtering
+    if (level == 0)
+    {
+        enc.filter = PNG_FILTER_NONE;
+    }
+    else if (level <= 3)
+    {
+        enc.filter = PNG_FILTER_UP;
+    }
+    else
+    {
+        enc.filter = PNG_FILTER_PAETH;
+    }
+
+    // Split the scanlines into chunks of roughly CHUNK_BYTES each
+    size_t row_size = 1 + (size_t)width * n_channels;
+    enc.rows_per_chunk = CHUNK_BYTES / row_size;
+    if (enc.rows_per_chunk < 1)
+    {
+        enc.rows_per_chunk = 1;
+    }
+    enc.n_chunks = (height + enc.rows_per_chunk - 1) / enc.rows_per_chunk;
+    enc.chunks = calloc(enc.n_chunks, sizeof(DeflateChunk));
+    if (!enc.chunks)
+    {
+        return 1;
+    }
+    pthread_mutex_init(&enc.lock, NULL);
+
+    // Deflate chunks in parallel; small images just run on this thread
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads > enc.n_chunks)
+    {
+        n_threads = enc.n_chunks;
+    }
+    pthread_t *threads = n_threads > 1 ? calloc(n_threads - 1, sizeof(pthread_t)) : NULL;
+    int started = 0;
+    for (int i = 0; threads && i < n_threads - 1; i++)
+    {
+        if (pthread_create(&threads[i], NULL, encode_worker, &enc) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+    encode_worker(&enc);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&enc.lock);
+
+    int status = 0;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (int i = 0; i < enc.n_chunks; i++)
+    {
+        if (enc.chunks[i].failed)
+        {
+            status = 1;
+        }
+        else
+        {
+            adler = adler32_combine(adler, enc.chunks[i].adler, enc.chunks[i].raw_size);
+        }
+    }
+
+    if (status == 0)
+    {
+        // Signature
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        fwrite(signature, 1, 8, outptr);
+
+        // IHDR: dimensions, bit depth 8, RGB or RGBA, no interlace
+        unsigned char ihdr[13];
+        put_be32(ihdr, width);
+        put_be32(ihdr + 4, height);
+        ihdr[8] = 8;
+        ihdr[9] = n_channels == 4 ? 6 : 2;
+        ihdr[10] = 0;
+        ihdr[11] = 0;
+        ihdr[12] = 0;
+        write_png_chunk(outptr, "IHDR", ihdr, sizeof(ihdr));
+
+        // The zlib header goes in front of the first chunk, with FLEVEL matching level
+        int flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        int cmf = 0x78;
+        int flg = flevel << 6;
+        flg += 31 - (cmf * 256 + flg) % 31;
+
+        // The Adler-32 of all the chunks goes after the last one
+        DeflateChunk *first = &enc.chunks[0];
+        DeflateChunk *last = &enc.chunks[enc.n_chunks - 1];
+        put_be32(last->data + 2 + last->size, adler);
+        last->size += 4;
+
+        // One IDAT per chunk, reporting progress by bytes written
+        first->data[0] = cmf;
+        first->data[1] = flg;
+        size_t total = 2, written = 0;
+        for (int i = 0; i < enc.n_chunks; i++)
+        {
+            total += enc.chunks[i].size;
+        }
+        for (int i = 0; i < enc.n_chunks; i++)
+        {
+            DeflateChunk *chunk = &enc.chunks[i];
+            if (i == 0)
+            {
+                write_png_chunk(outptr, "IDAT", chunk->data, chunk->size + 2);
+                written += chunk->size + 2;
+            }
+            else
+            {
+                write_png_chunk(outptr, "IDAT", chunk->data + 2, chunk->size);
+                written += chunk->size;
+            }
+            if (progress && i < enc.n_chunks - 1)
+            {
+                progress(ENCODE_SHARE + (1 - ENCODE_SHARE) * written / total, data);
+            }
+        }
+        write_png_chunk(outptr, "IEND", NULL, 0);
+        if (progress)
+        {
+            progress(1.0, data);
+        }
+
+        if (ferror(outptr))
+        {
+            status = 1;
+        }
+    }
+
+    for (int i = 0; i < enc.n_chunks; i++)
+    {
+        free(enc.chunks[i].data);
+    }
+    free(enc.chunks);
+    return status;
+}
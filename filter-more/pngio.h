@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+// Called with the fraction of the export done so far, possibly from worker threads
+// Encoding fills most of the range and writing the file the rest, so 1.0 means written
+typedef void (*ExportProgress)(double fraction, void *data);
+
+// Write 8-bit RGB (n_channels 3) or RGBA (n_channels 4) pixels as a PNG
+// level is the zlib compression level, 0 (fastest) to 9 (smallest); large
+// images are deflated in parallel chunks. progress may be NULL.
+// Returns 0 on success, 1 on error
+int write_png(FILE *outptr, int height, int width, int n_channels, int rowstride,
+              const unsigned char *pixels, int level, ExportProgress progress, void *data);